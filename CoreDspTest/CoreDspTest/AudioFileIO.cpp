@@ -1,4 +1,6 @@
 #include <AudioToolbox/AudioToolbox.h>
+#include "AudioFileIO.hpp"
+#include <algorithm>
 
 bool WriteTestFile(const char *fileName, float sampleRate, UInt32 nChannels, float** samps, int frameCnt) {
   
@@ -73,3 +75,102 @@ float** ReadTestFile(const char *fileName, float& sampleRate, int& nChannels, in
   AudioFileClose(fid);
   return samps;
 }
+
+bool AudioFileReader::Open(const char *fileName) {
+  Close();
+  AudioFileID fid;
+  CFStringRef str = CFStringCreateWithCString(NULL, fileName, kCFStringEncodingUTF8);
+  CFURLRef url = CFURLCreateWithFileSystemPath(NULL, str, kCFURLPOSIXPathStyle, false);
+  CFRelease(str);
+  OSStatus err = AudioFileOpenURL(url, kAudioFileReadPermission, 0, &fid);
+  CFRelease(url);
+  if (err != noErr) return false;
+  file = fid;
+
+  UInt32 dataSize = sizeof(AudioStreamBasicDescription);
+  AudioStreamBasicDescription asbd;
+  SInt64 byteCount = 0;
+  err = AudioFileGetProperty(fid, kAudioFilePropertyDataFormat, &dataSize, &asbd);
+  if (err != noErr) { Close(); return false; }
+  dataSize = sizeof(byteCount);
+  err = AudioFileGetProperty(fid, kAudioFilePropertyAudioDataByteCount, &dataSize, &byteCount);
+  if (err != noErr) { Close(); return false; }
+
+  if (asbd.mFormatID != kAudioFormatLinearPCM ||
+      asbd.mFormatFlags != (kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked) ||
+      asbd.mBitsPerChannel != 32 || asbd.mChannelsPerFrame == 0) {
+    Close();
+    return false;
+  }
+  nChannels = asbd.mChannelsPerFrame;
+  sampleRate = asbd.mSampleRate;
+  frameCnt = byteCount / (4 * nChannels);
+  position = 0;
+  return true;
+}
+
+int AudioFileReader::Read(float** samps, int maxFrames) {
+  if (!file) return -1;
+  int nFrames = (int) std::min<int64_t>(maxFrames, frameCnt - position);
+  if (nFrames <= 0) return 0;
+  interleaved.resize(nFrames * nChannels);
+  UInt32 byteCnt = nFrames * nChannels * 4;
+  OSStatus err = AudioFileReadBytes((AudioFileID) file, false, position * nChannels * 4, &byteCnt, interleaved.data());
+  if (err != noErr && err != kAudioFileEndOfFileError) return -1;
+  nFrames = byteCnt / (nChannels * 4);
+  if (nFrames == 0) return -1;    // the file is shorter than its header says
+  for (int ch = 0; ch < nChannels; ch++) {
+    const float* in = interleaved.data() + ch;
+    for (int i = 0; i < nFrames; i++) { samps[ch][i] = in[i * nChannels]; }
+  }
+  position += nFrames;
+  return nFrames;
+}
+
+void AudioFileReader::Close() {
+  if (file) { AudioFileClose((AudioFileID) file); }
+  file = nullptr;
+}
+
+bool AudioFileWriter::Create(const char *fileName, float sampleRate, int nChannels) {
+  Close();
+  AudioStreamBasicDescription asbd = {0};
+  asbd.mSampleRate = sampleRate;
+  asbd.mFormatID = kAudioFormatLinearPCM;
+  asbd.mBitsPerChannel = 32;
+  asbd.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+  asbd.mFramesPerPacket = 1;
+  asbd.mChannelsPerFrame = nChannels;
+  asbd.mBytesPerFrame = 4 * nChannels;
+  asbd.mBytesPerPacket = 4 * nChannels;
+
+  AudioFileID fid;
+  CFStringRef str = CFStringCreateWithCString(NULL, fileName, kCFStringEncodingUTF8);
+  CFURLRef url = CFURLCreateWithFileSystemPath(NULL, str, kCFURLPOSIXPathStyle, false);
+  CFRelease(str);
+  OSStatus err = AudioFileCreateWithURL(url, kAudioFileWAVEType, &asbd, kAudioFileFlags_EraseFile, &fid);
+  CFRelease(url);
+  if (err != noErr) return false;
+  file = fid;
+  this->nChannels = nChannels;
+  byteOffset = 0;
+  return true;
+}
+
+bool AudioFileWriter::Write(float** samps, int nFrames) {
+  if (!file) return false;
+  interleaved.resize(nFrames * nChannels);
+  for (int ch = 0; ch < nChannels; ch++) {
+    float* out = interleaved.data() + ch;
+    for (int i = 0; i < nFrames; i++) { out[i * nChannels] = samps[ch][i]; }
+  }
+  UInt32 byteCnt = nFrames * nChannels * 4;
+  OSStatus err = AudioFileWriteBytes((AudioFileID) file, false, byteOffset, &byteCnt, interleaved.data());
+  byteOffset += byteCnt;
+  return err == noErr;
+}
+
+void AudioFileWriter::Close() {
+  if (file) { AudioFileClose((AudioFileID) file); }
+  file = nullptr;
+}
@@ -1,4 +1,38 @@
 #pragma once
 
+#include <stdint.h>
+#include <vector>
+
 bool WriteTestFile(const char *fileName, float sampleRate, UInt32 nChannels, float** samps, int frameCnt);
 float** ReadTestFile(const char *fileName, float& sampleRate, int& nChannels, int& frameCnt);
+
+// Streaming access to 32 bit float WAV files, a block of frames at a time, for files
+// too long to hold in memory. Samples are handed in and out a buffer per channel.
+
+struct AudioFileReader {
+  void* file = nullptr;
+  float sampleRate = 0;
+  int nChannels = 0;
+  int64_t frameCnt = 0;
+  int64_t position = 0;
+  std::vector<float> interleaved;
+
+  ~AudioFileReader() { Close(); }
+  bool Open(const char *fileName);
+  // Reads up to maxFrames frames, and returns how many it read, 0 at the end of the file
+  // and -1 if the file couldn't be read
+  int Read(float** samps, int maxFrames);
+  void Close();
+};
+
+struct AudioFileWriter {
+  void* file = nullptr;
+  int nChannels = 0;
+  int64_t byteOffset = 0;
+  std::vector<float> interleaved;
+
+  ~AudioFileWriter() { Close(); }
+  bool Create(const char *fileName, float sampleRate, int nChannels);
+  bool Write(float** samps, int nFrames);
+  void Close();
+};
@@ -0,0 +1,178 @@
+//
+// Offline rendering of many files through a graph, on every core.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "AudioFileIO.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <thread>
+
+using namespace DspBlocks;
+
+/*
+ Rendering a corpus of files offline is a throughput problem, not a latency one. Each
+ worker thread makes its own graph from the factory, so workers share nothing but the
+ index of the next job, and takes the jobs one whole file at a time. A file is streamed
+ through the graph in blocks of blockFrames frames, read straight into the graph's input
+ buffers and written from its output buffers, so no file is ever held in memory and each
+ kernel call covers a large block.
+
+ The graph is made for the wire spec of the file: its channel count and sample rate, and
+ blockFrames as the buffer size. A worker keeps its graph for as long as the files it
+ takes have the same spec, and re-initializes its blocks at the start of each file, so
+ nothing carries over from one file to the next. A file with a different spec gets a new
+ graph. In a multi-rate graph, the last block of a file is padded with zeros to a
+ multiple of the graph's frame quantum, and the padding isn't written out. A file which
+ fails after its output has been created, because it couldn't be read or written or its
+ graph threw, has the partial output deleted, so every output file left is complete.
+
+ The realtime factor of a file is its length over the time its worker took to render it,
+ including the file I/O. The aggregate factor is the length of all the files over the
+ wall clock time of the whole batch, so it counts every core.
+ */
+
+struct RenderJob {
+  string inputPath;
+  string outputPath;
+  double audioSeconds = 0;
+  double renderSeconds = 0;
+  bool done = false;
+  bool outputCreated = false;
+  string error;
+};
+
+// Makes a graph prepared for the wire spec, with its blocks initialized. It is called
+// from the worker threads, at the same time, so it mustn't share anything between the
+// graphs it makes, and shouldn't print. It may return nullptr or throw if it can't make
+// one, which fails the file.
+typedef function<GraphBase*(WireSpec)> GraphFactory;
+
+struct BatchRenderer {
+  GraphFactory factory;
+  uint nWorkers;
+  uint blockFrames;
+  vector<RenderJob> jobs;
+  atomic<uint> nextJob;
+  double wallSeconds = 0;
+
+  // With no worker count given, there is a worker for every core
+  BatchRenderer(GraphFactory factory, uint nWorkers = 0, uint blockFrames = 4096) :
+          factory(factory), nWorkers(nWorkers), blockFrames(blockFrames), nextJob(0) {
+    if (this->nWorkers == 0) { this->nWorkers = max(thread::hardware_concurrency(), 1u); }
+  }
+
+  void Add(const string& inputPath, const string& outputPath) {
+    RenderJob job;
+    job.inputPath = inputPath;
+    job.outputPath = outputPath;
+    jobs.push_back(job);
+  }
+
+  void Run() {
+    nextJob = 0;
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    uint n = min(nWorkers, (uint) jobs.size());
+    for (uint i = 0; i < n; i++) { workers.emplace_back(&BatchRenderer::Work, this); }
+    for (auto& worker : workers) { worker.join(); }
+    wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  void Work() {
+    unique_ptr<GraphBase> graph;
+    WireSpec spec;
+    for (uint idx; (idx = nextJob.fetch_add(1)) < jobs.size(); ) {
+      auto start = chrono::steady_clock::now();
+      try {
+        Render(jobs[idx], graph, spec);
+      } catch (DspError err) {
+        jobs[idx].error = err.msg;
+      } catch (exception& err) {
+        jobs[idx].error = err.what();   // bad_alloc and the like fail the file, not the batch
+      }
+      // the writer has been closed by now, even if Render threw
+      if (!jobs[idx].done && jobs[idx].outputCreated) { remove(jobs[idx].outputPath.c_str()); }
+      jobs[idx].renderSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  void Render(RenderJob& job, unique_ptr<GraphBase>& graph, WireSpec& spec) {
+    AudioFileReader reader;
+    if (!reader.Open(job.inputPath.c_str())) {
+      job.error = "can't read input file, or it isn't 32 bit float";
+      return;
+    }
+    WireSpec ws(reader.nChannels, reader.sampleRate, blockFrames);
+    if (graph && ws == spec) {
+      graph->InitBlocks();
+    } else {
+      graph.reset();
+      graph.reset(factory(ws));
+      if (!graph || !graph->prepared) {
+        graph.reset();
+        job.error = "graph couldn't be prepared for the file";
+        return;
+      }
+      spec = ws;
+    }
+
+    float** inBufs; float** outBufs;
+    graph->GetPortBuffers(inBufs, outBufs);
+    uint outChannels = graph->outputPorts[0].getInputPins()[0].wireSpec.nChannels;
+    AudioFileWriter writer;
+    if (!writer.Create(job.outputPath.c_str(), reader.sampleRate, outChannels)) {
+      job.error = "can't create output file";
+      return;
+    }
+    job.outputCreated = true;
+    uint quantum = graph->frameQuantum;
+    uint maxFrames = graph->maxFrames / quantum * quantum;
+    for (;;) {
+      int n = reader.Read(inBufs, maxFrames);
+      if (n < 0) {
+        job.error = "can't read input file";
+        return;
+      }
+      if (n == 0) break;
+      uint padded = (n + quantum - 1) / quantum * quantum;
+      for (uint ch = 0; ch < spec.nChannels; ch++) { fill(inBufs[ch] + n, inBufs[ch] + padded, 0.0f); }
+      graph->process(padded);
+      if (!writer.Write(outBufs, n)) {
+        job.error = "can't write output file";
+        return;
+      }
+    }
+    writer.Close();
+    job.audioSeconds = reader.position / reader.sampleRate;
+    job.done = true;
+  }
+
+  // ------------------ Reporting --------------------
+
+  void Report() {
+    double totalAudio = 0;
+    uint nDone = 0;
+    for (auto& job : jobs) {
+      if (!job.done) {
+        printf("%s: failed, %s\n", job.inputPath.c_str(), job.error.c_str());
+        continue;
+      }
+      nDone++;
+      totalAudio += job.audioSeconds;
+      printf("%s: %.2f s of audio in %.3f s, %.1fx realtime\n", job.inputPath.c_str(),
+             job.audioSeconds, job.renderSeconds, job.audioSeconds / max(job.renderSeconds, 1e-9));
+    }
+    printf("%u of %zu files, %.2f s of audio in %.3f s on %u workers, %.1fx realtime\n",
+           nDone, jobs.size(), totalAudio, wallSeconds, min(nWorkers, (uint) jobs.size()),
+           totalAudio / max(wallSeconds, 1e-9));
+  }
+
+};
@@ -0,0 +1,197 @@
+//
+// Timing of graph preparation for large generated graphs, and of the ways around it, and
+// of running many copies of a small graph at once.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "Sources.hpp"
+#include "Mixers.hpp"
+#include "GraphImage.hpp"
+#include "BatchedGraph.hpp"
+
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+
+using namespace DspBlocks;
+
+// A generated graph with nBlocks blocks: a chain of mixers hanging off the input port,
+// each mixer with its own oscillator on the second input. The chain is as deep as the
+// graph is big, which is the worst case for the old recursive scheduler.
+
+struct GeneratedGraph : GraphBase {
+  vector<unique_ptr<TwoInputMixer>> mixers;
+  vector<unique_ptr<SineGen>> oscs;
+  WireSpec wireSpec;
+
+  GeneratedGraph(WireSpec ws, uint nBlocks) : GraphBase(1,1) {
+    wireSpec = ws;
+    DspInterface* prev = &inputPorts[0];
+    for (uint i = 0; i < nBlocks / 2; i++) {
+      mixers.emplace_back(new TwoInputMixer());
+      oscs.emplace_back(new SineGen(100 + i));
+      Connect(prev, mixers.back().get());
+      Connect(oscs.back().get(), 0, mixers.back().get(), 1);
+      prev = mixers.back().get();
+    }
+    Connect(prev, &outputPorts[0]);
+  }
+
+  WireSpec getInputWireSpec(unsigned int idx) override { return wireSpec; }
+  WireSpec getOutputWireSpec(unsigned int idx) override { return wireSpec; }
+  bool updateWireSpecs() override { return false; }
+
+};
+
+// Prints the time PrepareForOperation takes for a range of graph sizes, and the number
+// of buffers the graph ends up with. With the compiled topology the time per block
+// should stay flat as the graph grows.
+
+inline void RunScheduleBenchmark() {
+  using Clock = chrono::steady_clock;
+  WireSpec ws(1, 48000, 64);
+  printf("%8s %12s %12s %8s\n", "blocks", "prepare ms", "us/block", "buffers");
+  for (uint nBlocks : { 1000, 2000, 5000, 10000 }) {
+    GeneratedGraph graph(ws, nBlocks);
+    auto start = Clock::now();
+    graph.PrepareForOperation(ws, true);
+    chrono::duration<double, micro> elapsed = Clock::now() - start;
+    printf("%8u %12.2f %12.3f %8u\n", nBlocks, elapsed.count() / 1000, elapsed.count() / nBlocks,
+           graph.PeakBufferCount());
+  }
+}
+
+// Prints the time it takes to prepare a generated graph and initialize its blocks, next
+// to the time LoadGraphImage takes to give back the same graph ready to run, from an
+// image written to path. The image is removed afterwards.
+
+inline void RunImageBenchmark(const char* path = "bench-image.dspg") {
+  using Clock = chrono::steady_clock;
+  WireSpec ws(1, 48000, 64);
+  printf("%8s %12s %12s %10s\n", "blocks", "prepare ms", "load ms", "image KB");
+  for (uint nBlocks : { 1000, 2000, 4000, 8000 }) {
+    GeneratedGraph graph(ws, nBlocks);
+    auto start = Clock::now();
+    graph.PrepareForOperation(ws, true);
+    graph.InitBlocks();
+    chrono::duration<double, milli> prepare = Clock::now() - start;
+    SaveGraphImage(graph, path);
+    start = Clock::now();
+    auto loaded = LoadGraphImage(path);
+    chrono::duration<double, milli> load = Clock::now() - start;
+    printf("%8u %12.2f %12.2f %10.1f\n", nBlocks, prepare.count(), load.count(),
+           WriteGraphImage(graph).bytes.size() / 1024.0);
+  }
+  remove(path);
+}
+
+// Prints the time Recompile takes to bring a prepared 4000 block graph up to date after
+// a small batch of edits, next to the time PrepareForOperation takes for the same graph.
+// The edits alternate between putting a new gain into the mixer chain, which reorders
+// and adds a buffer, and moving a mixer's second input to another oscillator.
+
+inline void RunRecompileBenchmark(uint nBatches = 50) {
+  using Clock = chrono::steady_clock;
+  WireSpec ws(1, 48000, 64);
+  vector<unique_ptr<Gain>> inserted;
+  GeneratedGraph graph(ws, 4000);
+  graph.PrepareForOperation(ws, true);
+  graph.InitBlocks();
+  uint nMixers = (uint) graph.mixers.size();
+  double insertMicros = 0, rewireMicros = 0;
+  for (uint batch = 0; batch < nBatches; batch++) {
+    TwoInputMixer* mixer = graph.mixers[(batch * 37 + 1) % nMixers].get();
+    if (batch % 2 == 0) {
+      auto& in = mixer->getInputPins()[0].source;
+      DspInterface* src = in.block;
+      int srcPin = in.pinIdx;
+      inserted.emplace_back(new Gain());
+      graph.Disconnect(src, srcPin, mixer, 0);
+      graph.Connect(src, srcPin, inserted.back().get(), 0);
+      graph.Connect(inserted.back().get(), 0, mixer, 0);
+    } else {
+      graph.Disconnect(mixer->getInputPins()[1].source.block, 0, mixer, 1);
+      graph.Connect(graph.oscs[(batch * 53) % nMixers].get(), 0, mixer, 1);
+    }
+    auto start = Clock::now();
+    graph.Recompile();
+    chrono::duration<double, micro> elapsed = Clock::now() - start;
+    (batch % 2 == 0 ? insertMicros : rewireMicros) += elapsed.count();
+  }
+  auto start = Clock::now();
+  graph.PrepareForOperation(ws, true);
+  chrono::duration<double, micro> prepare = Clock::now() - start;
+  uint nInserts = (nBatches + 1) / 2, nRewires = nBatches / 2;
+  printf("%u blocks: prepare %.2f ms, recompile after an insert %.3f ms, after a rewire %.3f ms\n",
+         (uint) graph.blocks.size(), prepare.count() / 1000, insertMicros / max(nInserts, 1u) / 1000,
+         rewireMicros / max(nRewires, 1u) / 1000);
+}
+
+// A small voice, of the kind a host runs hundreds of: the input through a gain, mixed
+// with an oscillator, then through a gain and a clip. It isn't fused, so it can be
+// batched.
+
+struct VoiceGraph : GraphBase {
+  Gain in, out;
+  SineGen osc;
+  TwoInputMixer mixer;
+  Clip clip;
+  WireSpec wireSpec;
+
+  VoiceGraph(WireSpec ws, uint voice) : GraphBase(1,1) {
+    wireSpec = ws;
+    fuseElementwise = false;
+    in.gain = 0.5f + 0.05f * voice;
+    osc.frequency = 100 + 25 * voice;
+    Connect(&inputPorts[0], &in);
+    Connect(&in, 0, &mixer, 0);
+    Connect(&osc, 0, &mixer, 1);
+    Connect(&mixer, &out);
+    Connect(&out, &clip);
+    Connect(&clip, &outputPorts[0]);
+    PrepareForOperation(ws, true);
+    InitBlocks();
+  }
+
+  WireSpec getInputWireSpec(unsigned int idx) override { return wireSpec; }
+  WireSpec getOutputWireSpec(unsigned int idx) override { return wireSpec; }
+  bool updateWireSpecs() override { return false; }
+
+};
+
+// Prints the time per sample and instance of Lanes voices run as Lanes separate graphs,
+// next to the same voices run as one BatchedGraph, and how much faster the batch is.
+
+template <uint Lanes>
+void RunLanesBenchmark(uint nCycles) {
+  using Clock = chrono::steady_clock;
+  WireSpec ws(1, 48000, 64);
+  vector<unique_ptr<VoiceGraph>> voices;
+  for (uint lane = 0; lane < Lanes; lane++) { voices.emplace_back(new VoiceGraph(ws, lane)); }
+  BatchedGraph<Lanes> batch(*voices[0]);
+  batch.InitBlocks();
+  for (uint lane = 0; lane < Lanes; lane++) {
+    batch.SetParameter(lane, voices[0]->ParameterId(&voices[0]->in, "gain"), voices[lane]->in.gain);
+    batch.SetParameter(lane, voices[0]->ParameterId(&voices[0]->osc, "frequency"), voices[lane]->osc.frequency);
+  }
+  auto start = Clock::now();
+  for (uint cycle = 0; cycle < nCycles; cycle++) {
+    for (auto& voice : voices) { voice->process(); }
+  }
+  chrono::duration<double, nano> separate = Clock::now() - start;
+  start = Clock::now();
+  for (uint cycle = 0; cycle < nCycles; cycle++) { batch.process(); }
+  chrono::duration<double, nano> batched = Clock::now() - start;
+  double samples = (double) nCycles * ws.bufSize * Lanes;
+  printf("%6u %14.2f %14.2f %9.2fx\n", Lanes, separate.count() / samples, batched.count() / samples,
+         separate.count() / batched.count());
+}
+
+inline void RunLanesBenchmark(uint nCycles = 20000) {
+  printf("%6s %14s %14s %10s\n", "lanes", "separate ns", "batched ns", "speedup");
+  RunLanesBenchmark<4>(nCycles);
+  RunLanesBenchmark<8>(nCycles);
+  RunLanesBenchmark<16>(nCycles);
+}
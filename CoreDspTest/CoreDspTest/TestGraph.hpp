@@ -7,6 +7,7 @@
 #include "GenericDsp.hpp"
 #include "Sources.hpp"
 #include "Mixers.hpp"
+#include "StaticGraph.hpp"
 
 #include <iostream>
 
@@ -17,7 +18,8 @@ struct Graph : GraphBase {
   SineGen osc1;
   WireSpec wireSpec;
 
-  Graph(WireSpec ws) : GraphBase(1,1) {
+  // A graph which isn't verbose doesn't describe itself, and leaves errors to the caller
+  Graph(WireSpec ws, bool verbose = true) : GraphBase(1,1) {
     wireSpec = ws;
 
     try {
@@ -30,12 +32,13 @@ struct Graph : GraphBase {
       Connect(&mixer, &outputPorts[0]);
 
       PrepareForOperation(wireSpec, true);
-      Describe();
+      if (verbose) { Describe(); }
 
       // initialize blocks
       InitBlocks();
 
     } catch (DspError err) {
+      if (!verbose) throw;
       cout << err.msg;
     }
   }
@@ -45,3 +48,22 @@ struct Graph : GraphBase {
   bool updateWireSpecs() override { return false; }
 
 };
+
+// The same graph with its topology fixed at compile time. Blocks are numbered by their
+// position in the StaticGraph's list: 0 is the mixer, 1 the oscillator.
+
+struct TestGraphEdges {
+  static constexpr StaticEdgeList<3> Edges() {
+    return {{ { StaticPort, 0, 0, 1 }, { 1, 0, 0, 0 }, { 0, 0, StaticPort, 0 } }};
+  }
+};
+
+struct StaticTestGraph : StaticGraph<TestGraphEdges, TwoInputMixer, SineGen> {
+
+  StaticTestGraph(WireSpec ws) : StaticGraph(ws) {
+    auto& osc1 = Block<1>();
+    osc1.frequency = 100;
+    osc1.amplitude = .3;
+  }
+
+};
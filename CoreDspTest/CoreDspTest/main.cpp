@@ -5,8 +5,41 @@
 #include <AudioToolbox/AudioToolbox.h>
 #include "AudioFileIO.hpp"
 #include "TestGraph.hpp"
+#include "ScheduleBenchmark.hpp"
+#include "BatchRender.hpp"
+#include <fstream>
+
+int main(int argc, const char* argv[]) {
+  if (argc > 1 && strcmp(argv[1], "--bench-schedule") == 0) {
+    RunScheduleBenchmark();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-image") == 0) {
+    RunImageBenchmark();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-recompile") == 0) {
+    RunRecompileBenchmark();
+    return 0;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-lanes") == 0) {
+    RunLanesBenchmark();
+    return 0;
+  }
+
+  // --batch-render <list file> [workers]: the list file holds an input and an output path
+  // per line, separated by whitespace
+  if (argc > 2 && strcmp(argv[1], "--batch-render") == 0) {
+    BatchRenderer renderer([](WireSpec ws) { return new Graph(ws, false); },
+                           argc > 3 ? (uint) atoi(argv[3]) : 0);
+    ifstream list(argv[2]);
+    string inputPath, outputPath;
+    while (list >> inputPath >> outputPath) { renderer.Add(inputPath, outputPath); }
+    renderer.Run();
+    renderer.Report();
+    return 0;
+  }
 
-int main() {
   float SR;
   int nChannels;
   int nSamples;
@@ -19,17 +52,30 @@ int main() {
 
   WireSpec ws(1, SR, bufSiz);
   Graph graph(ws);
+
+  // preparing a graph again has to leave it as it was
+  size_t nBlocks = graph.blocks.size();
+  try {
+    graph.PrepareForOperation(ws, true);
+    graph.InitBlocks();
+  } catch (DspError err) {
+    cout << err.msg;
+    exit(-1);
+  }
+  if (graph.blocks.size() != nBlocks) exit(-1);
+
   float** iBufs; float** oBufs;
   graph.GetPortBuffers(iBufs, oBufs);
 
-  int i;
-  for (i = 0; i + bufSiz <= nSamples; i += bufSiz) {
-    copy(&inSamps[0][i], &inSamps[0][i] + bufSiz, iBufs[0]);
-    graph.process();
-    copy(oBufs[0], oBufs[0] + bufSiz, &outSamps[0][i]);
+  // the last buffer is usually short
+  for (int i = 0; i < nSamples; i += bufSiz) {
+    int n = min(bufSiz, nSamples - i);
+    copy(&inSamps[0][i], &inSamps[0][i] + n, iBufs[0]);
+    graph.process(n);
+    copy(oBufs[0], oBufs[0] + n, &outSamps[0][i]);
   }
   
-  WriteTestFile("testout.wav", SR, nChannels, outSamps, i-1);
+  WriteTestFile("testout.wav", SR, nChannels, outSamps, nSamples);
   
   return 0;
 }
@@ -0,0 +1,173 @@
+//
+//  BatchedBlocks.hpp
+//
+//  Versions of the standard blocks which run many instances of themselves at once,
+//  one instance per SIMD lane.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "Mixers.hpp"
+#include "Sources.hpp"
+#include <Accelerate/Accelerate.h>
+#include <math.h>
+
+namespace DspBlocks {
+
+  /*
+   A lane block is Lanes instances of a block, for BatchedGraph. Its signals hold the
+   signals of all its instances, frame by frame with the lanes interleaved: sample f of
+   lane l on a channel is at f * Lanes + l, so a channel of nFrames frames is nFrames *
+   Lanes floats. The kernel takes the same KernelArgs as a block's, counting frames,
+   and makes one pass over them. Lanes is a compile time constant, so the loop over the
+   lanes of a frame has a fixed trip count and becomes one or two SIMD operations, and
+   each instance's parameters and state are an array of Lanes values which lines up with
+   it. Blocks which are the same for every sample, such as the mixer, just treat the
+   interleaved lanes as a longer buffer.
+
+   Each lane block is made from a block of the prototype graph, and starts out with that
+   block's parameters in every lane. getParameters lists the lane arrays of the
+   parameters in the order the prototype's getParameters lists them. A lane block must
+   process in place wherever its prototype does, since the buffers are the prototype's.
+   */
+
+  template <uint Lanes>
+  struct LaneBlock {
+    virtual ~LaneBlock() {}
+    virtual void init() {}
+    virtual void getParameters(vector<float*>& lanes) {}
+    virtual Kernel getKernel() = 0;
+  };
+
+  template <uint Lanes>
+  struct LaneMixer : LaneBlock<Lanes> {
+
+    LaneMixer(TwoInputMixer& prototype) {}
+
+    void run(const KernelArgs& args) {
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        uint f = args.firstFrame * Lanes;
+        vDSP_vadd(args.inputs[0][ch] + f, 1, args.inputs[1][ch] + f, 1, args.outputs[0][ch] + f, 1,
+                  args.nFrames * Lanes);
+      }
+    }
+
+    Kernel getKernel() override { return { &DspBase::RunKernel<LaneMixer>, this }; }
+  };
+
+  template <uint Lanes>
+  struct LaneGain : LaneBlock<Lanes> {
+    float gain[Lanes];
+
+    LaneGain(Gain& prototype) { fill(gain, gain + Lanes, prototype.gain); }
+
+    void run(const KernelArgs& args) {
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        const float* in = args.inputs[0][ch] + args.firstFrame * Lanes;
+        float* out = args.outputs[0][ch] + args.firstFrame * Lanes;
+        for (uint f = 0; f < args.nFrames; f++) {
+          for (uint l = 0; l < Lanes; l++) { out[f * Lanes + l] = in[f * Lanes + l] * gain[l]; }
+        }
+      }
+    }
+
+    Kernel getKernel() override { return { &DspBase::RunKernel<LaneGain>, this }; }
+    void getParameters(vector<float*>& lanes) override { lanes.push_back(gain); }
+  };
+
+  template <uint Lanes>
+  struct LaneClip : LaneBlock<Lanes> {
+    float low[Lanes];
+    float high[Lanes];
+
+    LaneClip(Clip& prototype) {
+      fill(low, low + Lanes, prototype.low);
+      fill(high, high + Lanes, prototype.high);
+    }
+
+    void run(const KernelArgs& args) {
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        const float* in = args.inputs[0][ch] + args.firstFrame * Lanes;
+        float* out = args.outputs[0][ch] + args.firstFrame * Lanes;
+        for (uint f = 0; f < args.nFrames; f++) {
+          for (uint l = 0; l < Lanes; l++) {
+            out[f * Lanes + l] = min(max(in[f * Lanes + l], low[l]), high[l]);
+          }
+        }
+      }
+    }
+
+    Kernel getKernel() override { return { &DspBase::RunKernel<LaneClip>, this }; }
+
+    void getParameters(vector<float*>& lanes) override {
+      lanes.push_back(low);
+      lanes.push_back(high);
+    }
+  };
+
+  // Like SineGen, writes channel 0 only. The phases of all lanes are laid out first,
+  // doubled since vvsinpif takes its argument in half turns, and then a single vvsinpif
+  // takes the sines of the whole buffer. Phases are kept within a turn.
+
+  template <uint Lanes>
+  struct LaneSine : LaneBlock<Lanes> {
+    float frequency[Lanes];
+    float amplitude[Lanes];
+    float phase[Lanes];
+    float sampleRate;
+
+    LaneSine(SineGen& prototype) : sampleRate(prototype.sharedWireSpec.sampleRate) {
+      fill(frequency, frequency + Lanes, prototype.frequency);
+      fill(amplitude, amplitude + Lanes, prototype.amplitude);
+      init();
+    }
+
+    void init() override { fill(phase, phase + Lanes, 0.0f); }
+
+    void run(const KernelArgs& args) {
+      float* out = args.outputs[0][0] + args.firstFrame * Lanes;
+      float increment[Lanes];
+      for (uint l = 0; l < Lanes; l++) { increment[l] = frequency[l] / sampleRate; }
+      for (uint f = 0; f < args.nFrames; f++) {
+        for (uint l = 0; l < Lanes; l++) {
+          out[f * Lanes + l] = 2 * phase[l];
+          phase[l] += increment[l];
+        }
+      }
+      for (uint l = 0; l < Lanes; l++) { phase[l] -= floorf(phase[l]); }
+      int n = (int) (args.nFrames * Lanes);
+      vvsinpif(out, out, &n);
+      for (uint f = 0; f < args.nFrames; f++) {
+        for (uint l = 0; l < Lanes; l++) { out[f * Lanes + l] *= amplitude[l]; }
+      }
+    }
+
+    Kernel getKernel() override { return { &DspBase::RunKernel<LaneSine>, this }; }
+
+    void getParameters(vector<float*>& lanes) override {
+      lanes.push_back(frequency);
+      lanes.push_back(amplitude);
+    }
+  };
+
+  template <uint Lanes>
+  struct LaneImpulse : LaneBlock<Lanes> {
+    bool sampZero[Lanes];
+
+    LaneImpulse(Impulse& prototype) { init(); }
+
+    void init() override { fill(sampZero, sampZero + Lanes, true); }
+
+    void run(const KernelArgs& args) {
+      float* out = args.outputs[0][0] + args.firstFrame * Lanes;
+      memset(out, 0, sizeof(float) * args.nFrames * Lanes);
+      for (uint l = 0; l < Lanes; l++) {
+        if (sampZero[l]) { out[l] = 1.0; sampZero[l] = false; }
+      }
+    }
+
+    Kernel getKernel() override { return { &DspBase::RunKernel<LaneImpulse>, this }; }
+  };
+
+}
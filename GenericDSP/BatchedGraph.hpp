@@ -0,0 +1,207 @@
+//
+//  BatchedGraph.hpp
+//
+//  Runs Lanes instances of a prepared graph at once, with the instances in SIMD lanes.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "BatchedBlocks.hpp"
+
+namespace DspBlocks {
+
+  /*
+   Hundreds of copies of one small graph, one per voice or per channel set, each with
+   its own GraphBase, pay for every kernel call and every short scalar loop once per
+   copy. A BatchedGraph holds Lanes copies of a prototype graph in one: every block of
+   the prototype is replaced by a lane block (see BatchedBlocks.hpp) which runs all the
+   copies, so one kernel call advances every instance, and per sample work is done
+   Lanes instances at a time. Lanes is 4, 8 or 16 to suit the SIMD width. More instances
+   than that take several BatchedGraphs.
+
+   The prototype has to be prepared, with fuseElementwise turned off, and every block in
+   it has to have a lane version registered under its class name (see LaneMakers), which
+   rules out resamplers and probes. The batched graph takes over the prototype's
+   schedule and its buffer assignment, with every buffer Lanes times as long. It doesn't
+   skip silent blocks, and its parameters are set directly rather than queued, by the
+   thread which calls process(). Parameter ids are the prototype's.
+
+   Every channel of the port buffers holds its frames with the lanes interleaved, as
+   lane signals do. WriteInput and ReadOutput copy one instance's signal in and out of
+   them, for hosts which don't produce and consume the interleaved form themselves.
+   */
+
+  template <uint Lanes>
+  using LaneMaker = LaneBlock<Lanes>* (*)(DspInterface& prototype);
+
+  template <class LaneType, class Prototype, uint Lanes>
+  LaneBlock<Lanes>* MakeLaneBlock(DspInterface& prototype) {
+    return new LaneType(static_cast<Prototype&>(prototype));
+  }
+
+  // The lane versions of blocks, by class name. Others can be added to it.
+  template <uint Lanes>
+  unordered_map<string, LaneMaker<Lanes>>& LaneMakers() {
+    static unordered_map<string, LaneMaker<Lanes>> makers = {
+      { "Two Input Mixer", &MakeLaneBlock<LaneMixer<Lanes>, TwoInputMixer, Lanes> },
+      { "Gain", &MakeLaneBlock<LaneGain<Lanes>, Gain, Lanes> },
+      { "Clip", &MakeLaneBlock<LaneClip<Lanes>, Clip, Lanes> },
+      { "SineGen", &MakeLaneBlock<LaneSine<Lanes>, SineGen, Lanes> },
+      { "Impulse", &MakeLaneBlock<LaneImpulse<Lanes>, Impulse, Lanes> },
+    };
+    return makers;
+  }
+
+  template <uint Lanes>
+  struct BatchedGraph {
+    BufferArena arena;
+    vector<float**> poolBuffers;
+    vector<unique_ptr<LaneBlock<Lanes>>> laneBlocks;    // by step
+    vector<GraphBase::PlanEntry> plan;
+    vector<float**> planBuffers;
+    vector<float*> parameterLanes;                      // by parameter id
+    float** inputBuffers = nullptr;
+    float** outputBuffers = nullptr;
+    WireSpec inputSpec;
+    WireSpec outputSpec;
+    uint maxFrames = 0;
+
+    BatchedGraph(GraphBase& prototype) {
+      if (!prototype.prepared) {
+        throw DspError("graph has not been prepared");
+      }
+      if (!prototype.chains.empty()) {
+        throw DspError("graph must be prepared without fusion to be batched");
+      }
+      AllocateBuffers(prototype);
+      MakeLaneBlocks(prototype);
+      BuildPlan(prototype);
+      MapParameters(prototype);
+    }
+
+    BatchedGraph(const BatchedGraph&) = delete;
+
+    // ------------------ Construction --------------------
+
+    void AllocateBuffers(GraphBase& prototype) {
+      auto& pool = *prototype.bufferPool;
+      poolBuffers.assign(pool.size(), nullptr);
+      for (uint buf = 0; buf < pool.size(); buf++) {
+        WireSpec ws = pool[buf].wireSpec;
+        ws.bufSize *= Lanes;
+        arena.Reserve(ws, &poolBuffers[buf]);
+      }
+      arena.Commit();
+      auto& inPin = prototype.inputPorts[0].getOutputPins()[0];
+      auto& outPin = prototype.outputPorts[0].getInputPins()[0].source.GetOutputPin();
+      inputSpec = inPin.wireSpec;
+      outputSpec = outPin.wireSpec;
+      inputBuffers = BufferOf(prototype, inPin);
+      outputBuffers = BufferOf(prototype, outPin);
+      maxFrames = inputSpec.bufSize;
+    }
+
+    float** BufferOf(GraphBase& prototype, OutputPin& pin) {
+      return poolBuffers[prototype.liveIntervals[prototype.pinIntervals[&pin]].buffer];
+    }
+
+    void MakeLaneBlocks(GraphBase& prototype) {
+      auto& makers = LaneMakers<Lanes>();
+      for (auto block : prototype.processing_order) {
+        auto maker = makers.find(block->getClassName());
+        if (maker == makers.end()) {
+          throw DspError(string("no lane version of block class ") + block->getClassName());
+        }
+        laneBlocks.emplace_back(maker->second(*block));
+      }
+    }
+
+    // As GraphBase::BuildPlan: planBuffers is sized first, so the args can point into it
+    void BuildPlan(GraphBase& prototype) {
+      size_t nPins = 0;
+      for (auto block : prototype.processing_order) {
+        nPins += block->getInputPins().size() + block->getOutputPins().size();
+      }
+      planBuffers.assign(nPins, nullptr);
+      plan.clear();
+      size_t next = 0;
+      for (uint step = 0; step < prototype.processing_order.size(); step++) {
+        auto block = prototype.processing_order[step];
+        auto& ins = block->getInputPins();
+        auto& outs = block->getOutputPins();
+        GraphBase::PlanEntry entry;
+        entry.kernel = laneBlocks[step]->getKernel();
+        entry.args = { &planBuffers[next], &planBuffers[next + ins.size()], 0, 0, 0, 0 };
+        for (auto& pin : ins) { planBuffers[next++] = BufferOf(prototype, pin.source.GetOutputPin()); }
+        for (auto& pin : outs) { planBuffers[next++] = BufferOf(prototype, pin); }
+        entry.args.nChannels = outs.empty() ? ins[0].wireSpec.nChannels : outs[0].wireSpec.nChannels;
+        plan.push_back(entry);
+      }
+    }
+
+    // Each block's parameters take consecutive ids, in the order of its getParameters
+    void MapParameters(GraphBase& prototype) {
+      parameterLanes.clear();
+      DspInterface* current = nullptr;
+      vector<float*> lanes;
+      uint idx = 0;
+      for (uint id = 0; id < prototype.parameters.size(); id++) {
+        auto block = prototype.parameterBlocks[id];
+        if (block != current) {
+          current = block;
+          lanes.clear();
+          laneBlocks[prototype.topology.schedulePos[prototype.BlockId(block)]]->getParameters(lanes);
+          idx = 0;
+        }
+        if (idx >= lanes.size()) {
+          throw DspError(string("lane version doesn't have the parameters of block class ") + block->getClassName());
+        }
+        parameterLanes.push_back(lanes[idx++]);
+      }
+    }
+
+    // ------------------ Operation --------------------
+
+    void InitBlocks() {
+      for (auto& block : laneBlocks) { block->init(); }
+    }
+
+    void SetParameter(uint lane, uint id, float value) {
+      if (id >= parameterLanes.size() || lane >= Lanes) {
+        throw DspError("no such parameter");
+      }
+      parameterLanes[id][lane] = value;
+    }
+
+    void WriteInput(uint lane, float** in, uint nFrames) {
+      for (uint ch = 0; ch < inputSpec.nChannels; ch++) {
+        float* buf = inputBuffers[ch];
+        for (uint f = 0; f < nFrames; f++) { buf[f * Lanes + lane] = in[ch][f]; }
+      }
+    }
+
+    void ReadOutput(uint lane, float** out, uint nFrames) {
+      for (uint ch = 0; ch < outputSpec.nChannels; ch++) {
+        const float* buf = outputBuffers[ch];
+        for (uint f = 0; f < nFrames; f++) { out[ch][f] = buf[f * Lanes + lane]; }
+      }
+    }
+
+    void process() { process(maxFrames); }
+
+    // Advances every instance by nFrames, which may be up to the prototype's buffer size
+    void process(uint nFrames) {
+      if (nFrames > maxFrames) {
+        throw DspError("more frames than the graph was prepared for");
+      }
+      for (auto& entry : plan) {
+        KernelArgs args = entry.args;
+        args.nFrames = nFrames;
+        entry.kernel.func(entry.kernel.state, args);
+      }
+    }
+
+  };
+
+}
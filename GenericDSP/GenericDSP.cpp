@@ -8,10 +8,49 @@
 
 #include "GenericDsp.hpp"
 #include "Sources.hpp"
+#include "Mixers.hpp"
+#include "Resamplers.hpp"
+#include "GraphImage.hpp"
+#include <limits.h>
 
  namespace DspBlocks {
 //   int Connection::IdCounter = 0;
    int GraphBase::BufferSpec::IdCounter = 0;
+
+   DspInterface* GraphBase::MakeResampler(uint decimation, uint interpolation, uint rateDivisor) {
+     Resampler* resampler;
+     if (decimation > 1) {
+       resampler = new Decimator(decimation);
+     } else {
+       resampler = new Interpolator(interpolation);
+     }
+     resampler->SetRateDivisor(rateDivisor);
+     return resampler;
+   }
+
+   // A factor below 2 has nothing to resample, and one too large has more taps than a
+   // uint can count
+   static uint ReadResamplingFactor(ImageReader& config) {
+     uint factor = config.Read<uint>();
+     if (factor < 2 || factor > UINT_MAX / Resampler::TapsPerPhase) {
+       throw DspError("graph image has a resampler with a bad factor");
+     }
+     return factor;
+   }
+
+   unordered_map<string, BlockMaker>& BlockMakers() {
+     static unordered_map<string, BlockMaker> makers = {
+       { "Two Input Mixer", &MakeBlock<TwoInputMixer> },
+       { "Gain", &MakeBlock<Gain> },
+       { "Clip", &MakeBlock<Clip> },
+       { "SineGen", &MakeBlock<SineGen> },
+       { "Impulse", &MakeBlock<Impulse> },
+       { "Probe", &MakeBlock<Probe> },
+       { "Decimator", [](ImageReader& config) -> DspBase* { return new Decimator(ReadResamplingFactor(config)); } },
+       { "Interpolator", [](ImageReader& config) -> DspBase* { return new Interpolator(ReadResamplingFactor(config)); } },
+     };
+     return makers;
+   }
  }
 
 
@@ -9,20 +9,39 @@
 #pragma once
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <vector>
+#include <memory>
+#include <unordered_map>
+#include <queue>
+#include <chrono>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <sstream>
 
+#include "LockFreeQueue.hpp"
+
 #define uint unsigned int
 using namespace std;
 
 namespace DspBlocks {
 
+  // Messages which name the blocks and pins involved are put together at run time, so
+  // the error keeps its own copy, and msg points into it.
+
   struct DspError {
+    string text;
     const char *msg;
-    DspError(const char *msg) :
-            msg(msg) {
+    DspError(const string& text) :
+            text(text), msg(this->text.c_str()) {
+    }
+    DspError(const DspError& other) : DspError(other.text) {}
+    DspError& operator=(const DspError& other) {
+      text = other.text;
+      msg = text.c_str();
+      return *this;
     }
   };
 
@@ -52,7 +71,7 @@ namespace DspBlocks {
     void Set(WireSpec ws) {
       if (*this == ws) return;
       if (!isEmpty()) {
-        throw new DspError("Can't set wirespec which is not empty and doesn't match");
+        throw DspError("Can't set wirespec which is not empty and doesn't match");
       } else {
         init(ws.nChannels, ws.sampleRate, ws.bufSize);
       }
@@ -78,16 +97,165 @@ namespace DspBlocks {
       ostringstream strm;
       strm << "nChannels: " << nChannels << " ";
       strm << "SR: " << sampleRate << " ";
-      strm << "bufSize: " << bufSize << " ";
+      strm << "bufSize: " << bufSize;
       return strm.str();
     }
 
   };
 
+  // All the signal buffers of a graph, in one 64 byte aligned block of memory which is
+  // freed as a unit. While the graph is prepared, each buffer is reserved along with the
+  // address of the float** which should end up pointing at it, and Commit then lays them
+  // all out and fills in those pointers. The channel pointer tables come first, then the
+  // samples. Every channel starts on a 64 byte boundary, i.e. its stride is padded to a
+  // multiple of the widest vector size.
+
+  struct BufferArena {
+    static const size_t Alignment = 64;
+    static const uint FloatsPerLine = Alignment / sizeof(float);
+
+    struct Reservation {
+      WireSpec wireSpec;
+      float*** target;
+    };
+
+    vector<Reservation> reservations;
+    char* memory = nullptr;
+    size_t size = 0;
+    bool locked = false;
+
+    BufferArena() {}
+    BufferArena(const BufferArena&) = delete;
+    BufferArena& operator=(const BufferArena&) = delete;
+    ~BufferArena() { Free(); }
+
+    static size_t RoundUp(size_t n) { return (n + Alignment - 1) / Alignment * Alignment; }
+    static uint Stride(uint bufSize) { return (uint) RoundUp(bufSize * sizeof(float)) / sizeof(float); }
+
+    void Reserve(const WireSpec& ws, float*** target) {
+      reservations.push_back({ ws, target });
+    }
+
+    // The memory is zeroed here, which means the buffers start out silent, and also that
+    // every page has been faulted in before the graph runs.
+
+    void Commit() {
+      Free();
+      size_t nPointers = 0;
+      size_t nFloats = 0;
+      for (auto& r : reservations) {
+        nPointers += r.wireSpec.nChannels;
+        nFloats += (size_t) r.wireSpec.nChannels * Stride(r.wireSpec.bufSize);
+      }
+      size_t tableBytes = RoundUp(nPointers * sizeof(float*));
+      size = tableBytes + nFloats * sizeof(float);
+      if (size == 0) return;
+      if (posix_memalign((void**) &memory, Alignment, size) != 0) {
+        memory = nullptr;
+        throw DspError("can't allocate buffer arena");
+      }
+      memset(memory, 0, size);
+      float** table = (float**) memory;
+      float* samples = (float*) (memory + tableBytes);
+      for (auto& r : reservations) {
+        *r.target = table;
+        for (uint ch = 0; ch < r.wireSpec.nChannels; ch++) {
+          *table++ = samples;
+          samples += Stride(r.wireSpec.bufSize);
+        }
+      }
+    }
+
+    // Keep the arena resident, so the audio thread never takes a page fault on it
+    bool Lock() {
+      if (memory != nullptr && !locked) { locked = (mlock(memory, size) == 0); }
+      return locked;
+    }
+
+    void Free() {
+      if (locked) { munlock(memory, size); locked = false; }
+      free(memory);
+      memory = nullptr;
+      size = 0;
+    }
+
+    void Reset() {
+      Free();
+      reservations.clear();
+    }
+
+  };
+
   struct InputPin;
   struct OutputPin;
 
+  // Everything a block's kernel needs for one call. inputs[pin][channel] and
+  // outputs[pin][channel] are the pin buffers, already resolved by the graph, so the
+  // kernel never has to go through the pins themselves. A kernel processes frames
+  // firstFrame .. firstFrame + nFrames - 1 of its buffers, since the graph may split a
+  // buffer where a parameter changes, and blocks which are channel independent may be
+  // handed just part of their channels, so their kernels only process channels
+  // firstChannel .. firstChannel + nChannels - 1.
+
+  struct KernelArgs {
+    float*** inputs;
+    float*** outputs;
+    uint firstFrame;
+    uint nFrames;
+    uint firstChannel;
+    uint nChannels;
+  };
+
+  typedef void (*KernelFunc)(void* state, const KernelArgs& args);
+
+  // The per-sample operation of an elementwise block, in a form the graph can compose:
+  // the graph fuses chains of such blocks into a single kernel (see GraphBase::FuseChains).
+  // Each operation applies to the signal coming down the chain. Parameters are read
+  // through pointers into the block, so they can still be changed while the graph runs.
+
+  struct ElementOp {
+    enum Kind { OpScale, OpAdd, OpClip };
+    Kind kind = OpScale;
+    const float* param1 = nullptr;    // OpScale: the gain, OpClip: the low limit
+    const float* param2 = nullptr;    // OpClip: the high limit
+    uint input = 0;                   // OpAdd: the other input, set by the graph
+  };
+
+  // What a signal holds for one cycle. A constant signal has the same value in every
+  // sample of a channel, and a silent one is all zeros, which makes it constant too. The
+  // order matters: the state of several signals together is the greatest of theirs.
+
+  enum SignalState : uint8_t {
+    SignalSilent,
+    SignalConstant,
+    SignalLive
+  };
+
+  // A kernel function bound to the block state it runs on
+
+  struct Kernel {
+    KernelFunc func = nullptr;
+    void* state = nullptr;
+  };
+
+  // A parameter of a block which can be changed while the graph runs
+  struct ParameterSpec {
+    const char* name;
+    float* value;
+  };
+
+  // A table of precomputed values a block would rather load from a graph image than
+  // compute again, and the number of values the block needs in it
+  struct TableSpec {
+    const char* name;
+    vector<float>* values;
+    size_t size;
+  };
+
+  struct ImageWriter;
+
   struct DspInterface {
+    virtual ~DspInterface() {}
     virtual vector<InputPin>& getInputPins() = 0;
     virtual vector<OutputPin>& getOutputPins() = 0;
     virtual WireSpec getInputWireSpec(uint pinIdx) = 0;
@@ -98,6 +266,81 @@ namespace DspBlocks {
     virtual const char* getClassName() = 0;
     virtual const char* getInstanceName() = 0;
     virtual bool IsPort() { return false; }
+    virtual bool IsGraph() { return false; }
+    virtual bool IsResampler() { return false; }
+
+    // Sinks are where a graph's signals end up: blocks with no outputs, such as probes,
+    // and the graph's output ports. Blocks which record or display their input and still
+    // pass it on can declare themselves sinks too. See GraphBase::SetSinkActive.
+    virtual bool IsSink() { return getOutputPins().empty(); }
+
+    // Blocks which need signal buffers of their own, besides the ones on their pins,
+    // reserve them here while the graph is prepared
+    virtual void ReserveBuffers(BufferArena& arena) {}
+
+    // A block whose kernel still works when an output buffer is also one of its input
+    // buffers returns the index of that input pin here, for the given output pin. The
+    // graph then hands the output the input's buffer whenever this block is the last
+    // reader of the input signal.
+    virtual int getInPlaceInput(uint outputPinIdx) { return -1; }
+
+    // A block which processes each channel on its own, with no state or signal shared
+    // between channels, returns true here. Its kernel may then be run on parts of the
+    // channel range at the same time, on different threads.
+    virtual bool IsChannelIndependent() { return false; }
+
+    // Blocks which know when their outputs are silent return true from TracksSilence.
+    // Each cycle, before such a block runs, the graph calls getOutputState with the
+    // state of its inputs taken together (silent for a block without inputs). If the
+    // block returns SignalSilent it isn't run at all, and its outputs are flagged silent;
+    // anything else is just passed on as the state of its outputs. A memoryless block
+    // returns the state of its inputs, a source returns silent while it has nothing to
+    // say, and a block with memory can use DspBase::SilentAfterTail.
+    virtual bool TracksSilence() { return false; }
+    virtual SignalState getOutputState(SignalState inputs, uint nFrames) { return SignalLive; }
+
+    // Elementwise blocks describe their operation here. OpScale and OpClip blocks have one
+    // input, OpAdd blocks two, and all of them have one output with the wire spec of
+    // their inputs.
+    virtual bool getElementOp(ElementOp& op) { return false; }
+
+    // Blocks which don't provide a kernel of their own get one that calls process()
+    static void ProcessKernel(void* state, const KernelArgs& args) {
+      static_cast<DspInterface*>(state)->process();
+    }
+
+    virtual Kernel getKernel() { return { &ProcessKernel, this }; }
+
+    // Blocks with state which should survive a graph being replaced by a new version of
+    // itself copy it here from their counterpart in the old graph, which is a block of
+    // the same class with the same instance name. This is called on the audio thread, so
+    // it must not allocate or lock. See GraphHost.
+    virtual void CopyStateFrom(DspInterface& other) {}
+
+    // Measuring a graph (GraphBase::MeasureStepCosts) runs its kernels, and mustn't leave
+    // the blocks changed. Blocks whose state running them changes append it here, and
+    // take it back in RestoreState, reading from state on and moving it past what they
+    // read.
+    virtual void SaveState(vector<float>& state) {}
+    virtual void RestoreState(const float*& state) {}
+
+    // Blocks list the parameters control threads may change here. The graph gives each
+    // one an id, and applies changes on the audio thread. See GraphBase::SetParameter.
+    virtual void getParameters(vector<ParameterSpec>& params) {}
+
+    // A block which should run at a fraction of the graph's sample rate returns the
+    // divisor here, and 0 to run at the rate of whatever it's connected to. The graph
+    // puts resamplers where rates meet. See GraphBase::InsertResamplers.
+    virtual uint getRateDivisor() { return 0; }
+
+    // Blocks which can be saved in a graph image write whatever their factory needs to
+    // construct them again here; parameter values are saved for them. Tables listed in
+    // getTables are saved too, and are already filled in when a block loaded from an
+    // image is initialized, so a block should only compute them in init() when they are
+    // empty. An image with a table of any other size than the one listed is rejected.
+    // See GraphImage.hpp.
+    virtual void SaveConfig(ImageWriter& config) {}
+    virtual void getTables(vector<TableSpec>& tables) {}
   };
 
   struct PinSpec {
@@ -117,6 +360,9 @@ namespace DspBlocks {
 
   };
 
+  string PinName(DspInterface* block, bool input, uint pinIdx);
+  DspError WireSpecConflict(PinSpec src, PinSpec dst);
+
   struct Pin {
     // Connection* connection = nullptr;
     WireSpec wireSpec;
@@ -124,57 +370,89 @@ namespace DspBlocks {
     int bufferId = -1;
     char* name = (char*) "";
 
-    void SetWireSpec(WireSpec& ws) {
-      if (wireSpec.isEmpty()) {
-        wireSpec = ws;
-      } else if (ws != wireSpec) {
-        throw new DspError("conflicting wire specs");
-      }
-    }
-
     virtual void PropagateWireSpecs() = 0;
 
   };
 
+  // Propagating a pin's wire spec hands it to the pins at the other end of its
+  // connections which don't have one yet. Those which have a different one are in
+  // conflict, and the error names both ends.
+
   struct OutputPin : Pin {
     vector<PinSpec> sinks;
 
-    void PropagateWireSpecs() {
-      for (auto &dst: sinks) {
-        auto& pin = dst.block->getInputPins()[dst.pinIdx];
-        Pin& ref = reinterpret_cast<Pin&>(pin);
-        ref.SetWireSpec(wireSpec);
-      }
-    }
+    void PropagateWireSpecs();
 
   };
 
+  // An output which gets its spec from one of its sinks passes it on to all the others.
+
   struct InputPin : Pin {
     PinSpec source;
 
     void PropagateWireSpecs() {
       if (source.IsEmpty()) {
-        throw new DspError("unconnected input");
+        throw DspError("unconnected input");
+      }
+      auto& pin = source.GetOutputPin();
+      if (pin.wireSpec.isEmpty()) {
+        pin.wireSpec = wireSpec;
+        pin.PropagateWireSpecs();
+      } else if (pin.wireSpec != wireSpec) {
+        for (auto& dst : pin.sinks) {
+          if (&dst.GetInputPin() == this) throw WireSpecConflict(source, dst);
+        }
       }
-      auto& pin = source.block->getOutputPins()[source.pinIdx];
-      Pin& ref = reinterpret_cast<Pin&>(pin);
-      ref.SetWireSpec(wireSpec);
     }
 
   };
 
+  inline void OutputPin::PropagateWireSpecs() {
+    for (auto &dst: sinks) {
+      auto& pin = dst.GetInputPin();
+      if (pin.wireSpec.isEmpty()) {
+        pin.wireSpec = wireSpec;
+      } else if (pin.wireSpec != wireSpec) {
+        throw WireSpecConflict(pin.source, dst);
+      }
+    }
+  }
+
+  // e.g. Gain "volume" input 0, or Gain input 0 for a block without an instance name
+  inline string PinName(DspInterface* block, bool input, uint pinIdx) {
+    ostringstream strm;
+    strm << block->getClassName();
+    if (*block->getInstanceName() != 0) { strm << " \"" << block->getInstanceName() << "\""; }
+    strm << (input ? " input " : " output ") << pinIdx;
+    Pin& pin = input ? static_cast<Pin&>(block->getInputPins()[pinIdx]) :
+                       static_cast<Pin&>(block->getOutputPins()[pinIdx]);
+    if (*pin.name != 0) { strm << " (" << pin.name << ")"; }
+    return strm.str();
+  }
+
+  inline DspError WireSpecConflict(PinSpec src, PinSpec dst) {
+    return DspError("conflicting wire specs: " +
+                    PinName(src.block, false, src.pinIdx) + " has " + src.GetOutputPin().wireSpec.Description() + ", " +
+                    PinName(dst.block, true, dst.pinIdx) + " has " + dst.GetInputPin().wireSpec.Description());
+  }
+
   struct DspBase: DspInterface {
     vector<InputPin> inputPins;
     vector<OutputPin> outputPins;
     vector<InputPin>& getInputPins() override { return inputPins; }
     vector<OutputPin>& getOutputPins() override { return outputPins; }
 
+    vector<float**> inputBuffers;   // scratch for PinArgs
+    vector<float**> outputBuffers;
+
     void init() override {};
     void process() override {};
 
     DspBase(int nInputPins, int nOutputPins) {
       inputPins = vector<InputPin>(nInputPins);
       outputPins = vector<OutputPin>(nOutputPins);
+      inputBuffers = vector<float**>(nInputPins);
+      outputBuffers = vector<float**>(nOutputPins);
     }
 
     DspBase(int nInputPins) : DspBase(nInputPins, 1) {}
@@ -186,8 +464,51 @@ namespace DspBlocks {
       outputPins.clear();
     }
 
+    string instanceName;
+
     char* getInstanceName() override {
-      return (char *) "";
+      return (char *) instanceName.c_str();
+    }
+
+    void SetInstanceName(const string& name) { instanceName = name; }
+
+    uint rateDivisor = 0;
+
+    uint getRateDivisor() override { return rateDivisor; }
+    void SetRateDivisor(uint divisor) { rateDivisor = divisor; }
+
+    // Blocks with a kernel implement it as a member function run(const KernelArgs&)
+    // and return RunKernel<their type> from getKernel. The member function gets inlined
+    // here, so running the block from a graph's plan costs one indirect call.
+
+    template <class Block>
+    static void RunKernel(void* state, const KernelArgs& args) {
+      static_cast<Block*>(state)->run(args);
+    }
+
+    // For blocks with memory, such as filters: the output goes silent once the inputs
+    // have been silent for longer than the block's tail.
+
+    uint silentFrames = 0;
+
+    SignalState SilentAfterTail(SignalState inputs, uint nFrames, uint tailFrames) {
+      if (inputs != SignalSilent) {
+        silentFrames = 0;
+        return SignalLive;
+      }
+      if (silentFrames >= tailFrames) return SignalSilent;
+      silentFrames += nFrames;
+      return SignalLive;
+    }
+
+    // Kernel arguments taken from the block's own pins, for when the block is processed
+    // on its own rather than from a graph's plan.
+
+    KernelArgs PinArgs() {
+      for (size_t i = 0; i < inputPins.size(); i++) { inputBuffers[i] = inputPins[i].buffers; }
+      for (size_t i = 0; i < outputPins.size(); i++) { outputBuffers[i] = outputPins[i].buffers; }
+      Pin& pin = !outputPins.empty() ? static_cast<Pin&>(outputPins[0]) : static_cast<Pin&>(inputPins[0]);
+      return { inputBuffers.data(), outputBuffers.data(), 0, pin.wireSpec.bufSize, 0, pin.wireSpec.nChannels };
     }
 
   };
@@ -216,13 +537,19 @@ namespace DspBlocks {
         return false;
       }
 
-      // now apply the wireSpec to all pins, detecting conflicts
+      // now apply the wireSpec to all pins, detecting conflicts. A pin which already has
+      // a different one got it from the pin it is connected to, which is named as well.
       bool did_something = false;
-      auto checkPin = [&](Pin& pin) {
+      auto checkPin = [&](Pin& pin, bool input, uint pinIdx, PinSpec other) {
         auto& pinWs = pin.wireSpec;
         if (sharedWireSpec != pinWs) {
-          if (!pinWs.isEmpty()) {
-            throw new DspError("Conflicting wirespecs within block");
+          if (input && other.IsEmpty()) {
+            throw DspError("unconnected input: " + PinName(this, true, pinIdx));
+          } else if (!pinWs.isEmpty()) {
+            string name = PinName(this, input, pinIdx);
+            if (!other.IsEmpty()) { name += ", connected to " + PinName(other.block, !input, other.pinIdx) + ","; }
+            throw DspError("conflicting wire specs within block: " + name + " has " +
+                           pinWs.Description() + ", the block has " + sharedWireSpec.Description());
           } else {
             pinWs = sharedWireSpec;
             pin.PropagateWireSpecs();
@@ -230,8 +557,11 @@ namespace DspBlocks {
           }
         }
       };
-      for (auto& pin : outputPins) { checkPin(reinterpret_cast<Pin&>(pin)); }
-      for (auto& pin : inputPins) { checkPin(reinterpret_cast<Pin&>(pin)); }
+      for (uint i = 0; i < outputPins.size(); i++) {
+        auto& sinks = outputPins[i].sinks;
+        checkPin(outputPins[i], false, i, sinks.empty() ? PinSpec() : sinks[0]);
+      }
+      for (uint i = 0; i < inputPins.size(); i++) { checkPin(inputPins[i], true, i, inputPins[i].source); }
       return did_something;
     }
 
@@ -255,6 +585,7 @@ namespace DspBlocks {
     bool topLevel = false;
     Port(int nIns, int nOuts) : DspBlockSingleWireSpec(nIns, nOuts) {}
     bool IsPort() override { return true; }
+    uint getRateDivisor() override { return 1; }
   };
 
   struct InputPort : InputPin, Port {
@@ -274,7 +605,6 @@ namespace DspBlocks {
       int Id;
       WireSpec wireSpec;
       float **buffers;
-      bool free = false;
 
       BufferSpec(WireSpec ws, float** bufs) {
         Id = IdCounter++;
@@ -287,17 +617,186 @@ namespace DspBlocks {
       }
     };
 
+    // Indexed adjacency of the blocks, built by CompileTopology. A block's id is its index
+    // in blocks. Edges are stored CSR style: the successors of block id are
+    // successors[successorStart[id]] .. successors[successorStart[id + 1] - 1], with one
+    // entry per connection. Ports are never scheduled, so edges from and to ports are left
+    // out, and inDegree only counts input pins fed by other blocks.
+
+    struct Topology {
+      vector<uint> successorStart;
+      vector<uint> successors;
+      vector<uint> inDegree;
+      vector<int> schedulePos;    // index in processing_order, -1 for ports
+    };
+
+    struct ParameterChange {
+      uint id;
+      float value;
+      uint offset;      // frame within the next buffer at which the change lands
+    };
+
+    // A queued change, with the step whose kernel reads the parameter
+    struct ParameterEvent {
+      uint step;
+      uint offset;
+      uint id;
+      float value;
+    };
+
+    // One step of the execution plan: a block's kernel with the buffers of its pins
+    // resolved. args.inputs and args.outputs point into planBuffers.
+
+    struct PlanEntry {
+      Kernel kernel;
+      KernelArgs args;
+    };
+
+    // The live range of the signal on one output pin, in schedule positions: it is
+    // written at start and last read at end. Signals from input ports start at -1, since
+    // the host writes them before the cycle, and signals which leave the graph through an
+    // output port end at schedule.size(), since the host reads them after the cycle.
+    // buffer is the index of the signal's buffer in the pool.
+
+    struct LiveInterval {
+      int start;
+      int end;
+      OutputPin* pin;
+      uint buffer;
+      bool handedOn;    // buffer was taken over in place by the block at end
+      bool fused;       // inside a fused chain, so it has no buffer at all
+    };
+
+    // A chain of elementwise blocks run as one kernel. Each block's output feeds only the
+    // next block, so the signals inside the chain are never stored: the kernel makes one
+    // pass over the frames in chunks small enough to stay in L1, applying every operation
+    // of the chain to a chunk before going on to the next. The chunk is kept in the
+    // output buffer. inputs are the signals the kernel reads, the one entering the chain
+    // first, and the kernel runs at the plan step of the chain's last block.
+
+    struct FusedChain {
+      static const uint ChunkFrames = 256;
+
+      vector<ElementOp> ops;
+      vector<OutputPin*> inputs;
+      vector<uint> steps;     // the blocks of the chain, in order
+
+      // Asks the blocks one by one, each given what the one before said. inputs covers
+      // every signal the chain reads, so a block adding a second signal is told no less
+      // than it would be on its own.
+      SignalState OutputState(const vector<DspInterface*>& processing_order, SignalState inputs, uint nFrames) {
+        for (auto step : steps) { inputs = processing_order[step]->getOutputState(inputs, nFrames); }
+        return inputs;
+      }
+
+      static void Run(void* state, const KernelArgs& args) {
+        auto& chain = *static_cast<FusedChain*>(state);
+        for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+          uint end = args.firstFrame + args.nFrames;
+          for (uint start = args.firstFrame; start < end; start += ChunkFrames) {
+            uint n = end - start;
+            if (n > ChunkFrames) { n = ChunkFrames; }
+            const float* src = args.inputs[0][ch] + start;
+            float* acc = args.outputs[0][ch] + start;
+            for (auto& op : chain.ops) {
+              switch (op.kind) {
+                case ElementOp::OpScale: {
+                  float gain = *op.param1;
+                  for (uint i = 0; i < n; i++) { acc[i] = src[i] * gain; }
+                  break;
+                }
+                case ElementOp::OpAdd: {
+                  const float* other = args.inputs[op.input][ch] + start;
+                  for (uint i = 0; i < n; i++) { acc[i] = src[i] + other[i]; }
+                  break;
+                }
+                case ElementOp::OpClip: {
+                  float low = *op.param1, high = *op.param2;
+                  for (uint i = 0; i < n; i++) { acc[i] = min(max(src[i], low), high); }
+                  break;
+                }
+              }
+              src = acc;
+            }
+          }
+        }
+      }
+    };
+
     vector<DspInterface*> blocks;
+    unordered_map<DspInterface*, uint> blockIds;
+    vector<unique_ptr<DspInterface>> ownedBlocks;   // the ones the graph inserted itself
+    // connections made and broken since the graph was last compiled, see Recompile
+    struct Edit {
+      PinSpec src;
+      PinSpec dst;
+      bool connected;
+    };
+    bool prepared = false;
+    vector<Edit> edits;
+    uint compiledBlocks = 0;    // blocks were added to the end of blocks since then
+    vector<char> orderMark;     // scratch for UpdateOrder
+    vector<uint> orderForward;
+    vector<uint> orderBackward;
+    vector<int> orderSlots;
+    unordered_map<InputPin*, uint> orderPending;   // new connections not ordered yet
     //vector<Connection*> connections;
     // these two are indexed by pin number
     vector<InputPort> inputPorts;
     vector<OutputPort> outputPorts;
     // used for determining processing order
+    Topology topology;
     vector<DspInterface*> sources;
-    //vector<DspInterface*> processed;
+    vector<uint> schedule;      // block ids in processing order
+    // fusion of elementwise chains; chainOf and runPos are by step
+    bool fuseElementwise = true;
+    vector<FusedChain> chains;
+    vector<int> chainOf;        // the chain a step belongs to, or -1
+    vector<uint> runPos;        // the step at which a step's inputs are actually read
     vector<DspInterface*> processing_order;
     vector<BufferSpec>* bufferPool = nullptr;
+    BufferArena arena;
+    vector<LiveInterval> liveIntervals;   // ordered by start
+    // Buffer reuse assumes blocks run one at a time in processing order. A graph which is
+    // going to be run by a parallel executor has to be prepared with this turned off, so
+    // every signal gets a buffer of its own and nothing is processed in place.
+    bool reuseBuffers = true;
+    uint attachedExecutors = 0;     // executors and hosts which run the graph, see Recompile
+    unordered_map<OutputPin*, uint> pinIntervals;   // index into liveIntervals
     bool topLevel = false;
+    // the flattened plan which process() runs, one entry per block in processing_order
+    vector<PlanEntry> plan;
+    vector<float**> planBuffers;
+    uint maxFrames = 0;             // the most frames process() can be asked for
+    uint frameQuantum = 1;          // what it can be asked for a multiple of
+    // demand on each plan step, and the steps feeding each step, CSR style
+    vector<uint> demand;
+    vector<uint> predecessorStart;
+    vector<uint> predecessors;
+    vector<char> sinkActive;        // by block id
+    vector<uint> demandWork;
+    // silence tracking: the signals each step reads and writes, CSR style, as indices
+    // into liveIntervals, the signals of the ports, the state of each signal in the
+    // current cycle, and whether each pool buffer is known to hold zeros
+    vector<uint> stepSignalStart;
+    vector<uint> stepSignals;
+    vector<uint> stepInputCount;
+    vector<char> stepTracksSilence;
+    vector<uint> inputPortSignals;
+    vector<uint> outputPortSignals;
+    vector<SignalState> signalStates;
+    vector<char> bufferZeroed;
+    vector<SignalState> inputPortStates;
+    // whether the last cycle had every input silent, ran no kernel and applied no
+    // parameter change, so that nothing in the graph can have changed. See InstancePool.
+    bool quiet = false;
+    // parameters, by id, and the changes control threads have queued for them
+    vector<ParameterSpec> parameters;
+    vector<DspInterface*> parameterBlocks;
+    vector<uint> parameterSteps;
+    MpscQueue<ParameterChange> parameterChanges;
+    vector<ParameterEvent> parameterEvents;     // this cycle's, by step and offset
+    static const uint ParameterQueueSize = 4096;
 
     GraphBase() {}
 
@@ -306,18 +805,31 @@ namespace DspBlocks {
       outputPorts = vector<OutputPort>(nOutputPins);
     }
 
+    ~GraphBase() {
+      delete bufferPool;
+    }
+
     const char* getClassName() override {
       return "Graph";
     }
 
+    bool IsGraph() override { return true; }
+
     // only adds the block if the block wasn't there before
     void AddBlock(DspInterface* block) {
-      auto it = find(blocks.begin(), blocks.end(), block);
-      if (it == blocks.end()) {
+      if (blockIds.emplace(block, (uint) blocks.size()).second) {
         blocks.push_back(block);
       }
     }
 
+    uint BlockId(DspInterface* block) {
+      auto it = blockIds.find(block);
+      if (it == blockIds.end()) {
+        throw DspError("block is not part of this graph");
+      }
+      return it->second;
+    }
+
     void Connect(DspInterface* src, int srcPinIdx, DspInterface* dst, int dstPinIdx) {
       AddBlock(src);
       AddBlock(dst);
@@ -330,13 +842,26 @@ namespace DspBlocks {
       srcPin.sinks.push_back(PinSpec(dst, dstPinIdx));
       dstPin.source = PinSpec(src, srcPinIdx);
 //      connections.push_back(conn);
+      if (prepared) { edits.push_back({ PinSpec(src, srcPinIdx), PinSpec(dst, dstPinIdx), true }); }
     }
 
     void Connect(DspInterface* src, DspInterface* dst) { Connect(src, 0, dst, 0); }
 
+    void Disconnect(DspInterface* src, int srcPinIdx, DspInterface* dst, int dstPinIdx) {
+      InputPin& dstPin = dst->getInputPins()[dstPinIdx];
+      if (dstPin.source.block != src || dstPin.source.pinIdx != (uint) srcPinIdx) {
+        throw DspError("attempt to disconnect pins which aren't connected");
+      }
+      RemoveSink(src->getOutputPins()[srcPinIdx], dst, dstPinIdx);
+      dstPin.source = PinSpec();
+      if (prepared) { edits.push_back({ PinSpec(src, srcPinIdx), PinSpec(dst, dstPinIdx), false }); }
+    }
+
+    void Disconnect(DspInterface* src, DspInterface* dst) { Disconnect(src, 0, dst, 0); }
+
     void TopLevelSetup(WireSpec wireSpec) {
       topLevel = true;
-      bufferPool = new vector<BufferSpec>();
+      if (bufferPool == nullptr) { bufferPool = new vector<BufferSpec>(); }
       auto func = [&](Port& port) {
         AddBlock(&port);
         port.sharedWireSpec = wireSpec;
@@ -346,8 +871,6 @@ namespace DspBlocks {
       auto& iPort = inputPorts[0];
       iPort.wireSpec = wireSpec;
       func(iPort);
-      iPort.buffers = wireSpec.AllocateBuffers();
-      iPort.getOutputPins()[0].buffers = iPort.buffers;
       auto& oPort = outputPorts[0];
       func(oPort);
     }
@@ -360,131 +883,347 @@ namespace DspBlocks {
     // ------------------ Graph Preparation ---------------------
 
     void PrepareForOperation(WireSpec ws, bool topLevel) {
+      FlattenSubgraphs();
+      RegisterParameters();
+      InsertResamplers();
       if (topLevel) { TopLevelSetup(ws); }
       PropagateSignals();
       DetermineProcessingOrder(*bufferPool);
+      BuildPlan();
+      ComputeDemand();
+      BuildSilenceTables();
+      prepared = true;
+      edits.clear();
+      compiledBlocks = (uint) blocks.size();
     }
 
 
-    // ------------------ Signal Propagation --------------------
+    // ------------------ Subgraph Flattening --------------------
 
     /*
-     For each block,
+     A graph used as a block inside another graph is never run as a graph of its own.
+     Before anything else is worked out, its blocks are spliced into the parent: every
+     block fed by one of the subgraph's input ports is connected straight to whatever
+     feeds the subgraph's matching input pin, and everything fed by one of the subgraph's
+     output pins is connected straight to the block feeding the matching output port. A
+     port which goes straight through to an output port is resolved the same way. After
+     that the subgraph's blocks are scheduled, given buffers and planned along with all
+     the others, so a subgraph costs nothing at run time.
+
+     This consumes the subgraph: its pins and ports are left unconnected, and its blocks
+     belong to the parent from then on. Subgraphs inside subgraphs are spliced in turn,
+     as they show up in the parent's block list.
+     */
 
-     1. If the wirespec of any output pins can be set based any the input pins,
-     set it.
+    void FlattenSubgraphs() {
+      bool spliced = false;
+      // blocks grows while this runs, as subgraphs are spliced in
+      for (size_t i = 0; i < blocks.size(); i++) {
+        if (blocks[i]->IsGraph()) {
+          SpliceSubgraph(*static_cast<GraphBase*>(blocks[i]));
+          spliced = true;
+        }
+      }
+      if (!spliced) return;
+      vector<DspInterface*> flat;
+      for (auto block : blocks) {
+        if (!block->IsGraph()) { flat.push_back(block); }
+      }
+      blocks.clear();
+      blockIds.clear();
+      for (auto block : flat) { AddBlock(block); }
+    }
 
-     2. If the wirespec of any input pins can be set based on the output pins,
-     set them.
+    static void RemoveSink(OutputPin& pin, DspInterface* block, uint pinIdx) {
+      auto& sinks = pin.sinks;
+      sinks.erase(remove_if(sinks.begin(), sinks.end(), [&](PinSpec& sink) {
+        return sink.block == block && sink.pinIdx == pinIdx;
+      }), sinks.end());
+    }
 
-     3. For each pin, follow the path through the connection to any other
-     pins, For each pin, if the wire spec is blank, set it. If not, check
-     to make sure there is no conflict and signal an error if there is one.
+    void SpliceSubgraph(GraphBase& sub) {
+      uint nIns = (uint) sub.inputPorts.size();
+      uint nOuts = (uint) sub.outputPorts.size();
+      // where the signal on each input port really comes from, outside the subgraph
+      vector<PinSpec> outerSources(nIns);
+      for (uint i = 0; i < nIns; i++) {
+        outerSources[i] = sub.inputPins[i].source;
+        if (outerSources[i].IsEmpty()) {
+          throw DspError("unconnected subgraph input");
+        }
+        RemoveSink(outerSources[i].GetOutputPin(), &sub, i);
+      }
+      auto resolve = [&](PinSpec inner) {
+        for (uint i = 0; i < nIns; i++) {
+          if (inner.block == static_cast<DspInterface*>(&sub.inputPorts[i])) return outerSources[i];
+        }
+        return inner;
+      };
 
-     Lather rinse repeat until nothing more can be propagated or we encounter
-     an error
-     */
+      for (uint j = 0; j < nOuts; j++) {
+        PinSpec inner = sub.outputPorts[j].getInputPins()[0].source;
+        if (inner.IsEmpty()) {
+          throw DspError("unconnected subgraph output");
+        }
+        RemoveSink(inner.GetOutputPin(), &sub.outputPorts[j], 0);
+        PinSpec src = resolve(inner);
+        for (auto& sink : sub.outputPins[j].sinks) {
+          sink.GetInputPin().source = src;
+          src.GetOutputPin().sinks.push_back(sink);
+        }
+        sub.outputPins[j].sinks.clear();
+        sub.outputPorts[j].getInputPins()[0].source = PinSpec();
+      }
 
-    void PropagateSignals() {
-      bool did_something;
-      for (auto& iPort: inputPorts) {
-        auto& pin = iPort.getOutputPins()[0];
-        pin.PropagateWireSpecs();
+      for (uint i = 0; i < nIns; i++) {
+        auto& portPin = sub.inputPorts[i].getOutputPins()[0];
+        for (auto& sink : portPin.sinks) {
+          if (sink.block->IsPort()) continue;   // went straight through, done above
+          sink.GetInputPin().source = outerSources[i];
+          outerSources[i].GetOutputPin().sinks.push_back(sink);
+        }
+        portPin.sinks.clear();
+        sub.inputPins[i].source = PinSpec();
       }
-      for (auto& iPort: outputPorts) {
-        auto& pin = iPort.getInputPins()[0];
-        pin.PropagateWireSpecs();
+
+      for (auto block : sub.blocks) {
+        if (!block->IsPort()) { AddBlock(block); }
       }
-      do {
-        did_something = false;
-        for (auto& block : blocks) {
-          if (block->updateWireSpecs()) { did_something = true; }
-        }
-      } while (did_something);
     }
 
 
-    // -------------------- Processing Order -----------------------
+    // ------------------ Rate Conversion --------------------
 
-    bool HasBeenProcessed(DspInterface* block) {
-      if (block->IsPort()) { return true; }
-      auto &po = processing_order;
-      return (find(po.begin(), po.end(), block) != po.end());
-    }
+    /*
+     Parts of a graph can run at a fraction of its sample rate: analysis branches, control
+     signals and the like cost that much less. Blocks say so with SetRateDivisor. Ports
+     run at the graph's rate, divisor 1. A block without a divisor of its own takes the
+     smallest one among the blocks it is connected to, directly or through other blocks
+     without one, so a reduced rate only spreads through parts of the graph which never
+     meet a faster signal, and where a slow branch joins a faster one, it is the slow
+     branch which gets resampled. Before wire specs are propagated, every connection
+     between blocks of different divisors gets a decimator or an interpolator by the
+     ratio, which has to be a whole number. A signal going to several blocks at the same
+     other rate is resampled once for all of them.
+     The resamplers then scale the sample rate and buffer size as wire specs propagate
+     through them, so every block sees its own rate, and the graph's buffer size has to
+     be a multiple of every divisor. The resampler blocks themselves are made by
+     MakeResampler, in GenericDSP.cpp, and are owned by the graph.
+
+     A graph may be prepared again, so the resamplers already in it are taken into
+     account: each has the divisor of its output side, which blocks fed by it pick up,
+     and the connections into it are left alone.
+     */
 
-    // Look for blocks which are either pure sources by nature (they have no input ports),
-    // or have all their input pins connected to input ports. Input ports themselves are
-    // not considered sources, because they do not need to be processed and already are
-    // connected to buffers. But for input ports, take this opportunity to propagate their
-    // output buffers (which should already be allocated) to the input pins of their
-    // destinations.
+    DspInterface* MakeResampler(uint decimation, uint interpolation, uint rateDivisor);
 
-    void FindSources() {
-      sources.clear();
-      for (auto &block : blocks) {
-        if (block->IsPort()) {
-          auto& pins = block->getOutputPins();
-          if (pins.empty()) continue; // output port
-          ConnectInputPinBuffers(pins[0]);
-          continue;
+    void InsertResamplers() {
+      bool multiRate = false;
+      for (auto block : blocks) {
+        if (!block->IsPort() && block->getRateDivisor() > 1) { multiRate = true; }
+      }
+      if (!multiRate) return;
+
+      // Spread the divisors smallest first, so each block is reached first from the
+      // smallest one it can get. A resampler's divisor is that of its output side, so it
+      // only passes it on downstream.
+      size_t nBlocks = blocks.size();
+      vector<uint> divisor(nBlocks);
+      typedef pair<uint, uint> Reached;   // a divisor, and the block which has it
+      priority_queue<Reached, vector<Reached>, greater<Reached>> work;
+      for (uint id = 0; id < nBlocks; id++) {
+        divisor[id] = blocks[id]->getRateDivisor();
+        if (divisor[id] != 0) { work.push({ divisor[id], id }); }
+      }
+      while (!work.empty()) {
+        uint id = work.top().second;
+        work.pop();
+        auto reach = [&](DspInterface* block) {
+          uint other = BlockId(block);
+          if (divisor[other] != 0) return;
+          divisor[other] = divisor[id];
+          work.push({ divisor[other], other });
+        };
+        for (auto& pin : blocks[id]->getOutputPins()) {
+          for (auto& sink : pin.sinks) { reach(sink.block); }
         }
-        bool isSource = true;
-        for (auto &pin : block->getInputPins()) {
-          if (!pin.source.block->IsPort()) {
-            isSource = false;
-            break;
+        if (blocks[id]->IsResampler()) continue;
+        for (auto& pin : blocks[id]->getInputPins()) {
+          if (!pin.source.IsEmpty()) { reach(pin.source.block); }
+        }
+      }
+      for (auto& d : divisor) { if (d == 0) { d = 1; } }
+
+      for (uint id = 0; id < nBlocks; id++) {
+        auto& outs = blocks[id]->getOutputPins();
+        for (uint pinIdx = 0; pinIdx < outs.size(); pinIdx++) {
+          auto& pin = outs[pinIdx];
+          vector<PinSpec> sinks = pin.sinks;
+          unordered_map<uint, DspInterface*> resamplers;   // by divisor
+          for (auto& sink : sinks) {
+            uint from = divisor[id], to = divisor[BlockId(sink.block)];
+            if (from == to || sink.block->IsResampler()) continue;
+            if (max(from, to) % min(from, to) != 0) {
+              throw DspError("rates of connected blocks aren't a whole number ratio apart");
+            }
+            auto& resampler = resamplers[to];
+            if (resampler == nullptr) {
+              resampler = to > from ? MakeResampler(to / from, 1, to) : MakeResampler(1, from / to, to);
+              ownedBlocks.emplace_back(resampler);
+              Connect(blocks[id], pinIdx, resampler, 0);
+            }
+            pin.sinks.erase(find_if(pin.sinks.begin(), pin.sinks.end(), [&](PinSpec& s) {
+              return s.block == sink.block && s.pinIdx == sink.pinIdx;
+            }));
+            sink.GetInputPin().source = PinSpec();
+            Connect(resampler, 0, sink.block, sink.pinIdx);
           }
         }
-        if (isSource) { sources.push_back(block); }
       }
     }
 
-    // A block can be processed if all its input data is ready, which means that all the
-    // blocks connected to it input pins have already been processed. Input ports by
-    // definition have already been processed, to make sure they won't be in processing_order.
-    // OutputPorts are also not processed, since they merely forward buffer pointers and
-    // don't copy data.
-    
-    bool CanProcessBlock(DspInterface* block) {
-      if (block->IsPort()) { return false; }
-      auto pins = block->getInputPins();
-      for (auto& pin : pins) {
-        if (!HasBeenProcessed(pin.source.block)) {
-          return false;
+
+    // ------------------ Signal Propagation --------------------
+
+    /*
+     The ports hand their specs to the pins they are connected to, and then each block
+     is updated once: a block sets whichever of its pins it can work out from the others,
+     and each pin it sets hands the spec on across its connections. Only a block with a
+     pin that changed can have anything new to work out, so after an update just the
+     blocks across the connections which got a spec are queued again: the sinks of
+     outputs the block set, and the sources whose outputs got a spec from its inputs,
+     along with their other sinks, since a source which gets its spec from one sink
+     passes it on to all of them. Specs are only ever filled in, so the pins which were
+     empty before the update tell which those are. A block fed by a source with many
+     sinks then doesn't queue them all again each time it is updated, only the first
+     time the source gets its spec. This ends when the queue is empty, which
+     is the same fixed point a sweep over the whole graph reaches, but a change only costs
+     work in proportion to how far it spreads.
+
+     Specs which don't agree are an error naming the pins at both ends.
+     */
+
+    void PropagateSignals() {
+      for (auto& iPort: inputPorts) {
+        auto& pin = iPort.getOutputPins()[0];
+        if (!pin.wireSpec.isEmpty()) { pin.PropagateWireSpecs(); }
+      }
+      for (auto& oPort: outputPorts) {
+        auto& pin = oPort.getInputPins()[0];
+        if (pin.source.IsEmpty()) {
+          throw DspError("unconnected input: " + PinName(&oPort, true, 0));
         }
+        if (!pin.wireSpec.isEmpty()) { pin.PropagateWireSpecs(); }
       }
-      return true;
+      vector<DspInterface*> work(blocks.rbegin(), blocks.rend());
+      PropagateFrom(work);
     }
 
-    void MarkAsProcessed(DspInterface* block) {
-      if (!block->IsPort()) {
-        processing_order.push_back(block);
+    void PropagateFrom(vector<DspInterface*>& work) {
+      vector<char> wasEmpty;    // the sources of the block's inputs, then its outputs
+      while (!work.empty()) {
+        auto block = work.back();
+        work.pop_back();
+        auto& ins = block->getInputPins();
+        auto& outs = block->getOutputPins();
+        wasEmpty.clear();
+        for (auto& pin : ins) {
+          wasEmpty.push_back(!pin.source.IsEmpty() && pin.source.GetOutputPin().wireSpec.isEmpty());
+        }
+        for (auto& pin : outs) { wasEmpty.push_back(pin.wireSpec.isEmpty()); }
+        if (!block->updateWireSpecs()) continue;
+        for (uint i = 0; i < ins.size(); i++) {
+          auto& src = ins[i].source;
+          if (!wasEmpty[i] || src.GetOutputPin().wireSpec.isEmpty()) continue;
+          work.push_back(src.block);
+          for (auto& sink : src.GetOutputPin().sinks) {
+            if (sink.block != block) { work.push_back(sink.block); }
+          }
+        }
+        for (uint i = 0; i < outs.size(); i++) {
+          if (!wasEmpty[ins.size() + i] || outs[i].wireSpec.isEmpty()) continue;
+          for (auto& sink : outs[i].sinks) { work.push_back(sink.block); }
+        }
       }
     }
 
-    // After a block has been processed, we usually will be able to reuse the input
-    // buffers, because they are not needed anymore. One exception to this is when
-    // another block that has not been processed is also connected to the pin which
-    // the source for our input pin(s). Another is when the source is an input port,
-    // we are at "top level", meaning the buffer was supplied by the host.
 
-    void FreeInputBuffers(DspInterface* block, vector<BufferSpec>& bufferPool) {
-      for (auto pin : block->getInputPins()) {
-        if (pin.source.block->IsPort()) continue;
-        auto& srcPin = pin.source.GetOutputPin();
-        bool canFree = true;
-        for (auto& dst : srcPin.sinks) {
-          if (HasBeenProcessed(dst.block)) continue;
-          canFree = false;
-        }
-        if (canFree) {
-          for (auto &bufSpec : bufferPool) {
-            if (bufSpec.buffers == pin.buffers) {
-              bufSpec.free = true;
+    // -------------------- Processing Order -----------------------
+
+    // Build the indexed adjacency for the graph. This is a single pass over all pins,
+    // so it is O(V+E); the only lookups are the hashed block ids of the sinks.
+
+    void CompileTopology() {
+      uint nBlocks = (uint) blocks.size();
+      auto& t = topology;
+      t.successorStart.assign(nBlocks + 1, 0);
+      t.inDegree.assign(nBlocks, 0);
+      auto forEachEdge = [&](auto func) {
+        for (uint id = 0; id < nBlocks; id++) {
+          if (blocks[id]->IsPort()) continue;
+          for (auto& pin : blocks[id]->getOutputPins()) {
+            for (auto& sink : pin.sinks) {
+              if (sink.block->IsPort()) continue;
+              func(id, BlockId(sink.block));
             }
           }
         }
+      };
+      forEachEdge([&](uint src, uint dst) {
+        t.successorStart[src + 1]++;
+        t.inDegree[dst]++;
+      });
+      for (uint id = 0; id < nBlocks; id++) {
+        t.successorStart[id + 1] += t.successorStart[id];
+      }
+      t.successors.resize(t.successorStart[nBlocks]);
+      vector<uint> fill(t.successorStart.begin(), t.successorStart.end() - 1);
+      forEachEdge([&](uint src, uint dst) { t.successors[fill[src]++] = dst; });
+    }
+
+    // Kahn's algorithm. Sources are blocks whose inputs are all fed by input ports (or
+    // that have no inputs at all), i.e. blocks with no scheduled predecessors. Each block
+    // is scheduled once the last of its predecessors has been, so every block and every
+    // edge is visited exactly once. The ready set is a stack, seeded so that sources come
+    // off it in the order they were added; that keeps the order depth first, so a block's
+    // outputs tend to be consumed soon after they are produced, which keeps the number of
+    // live buffers down. A graph with a feedback loop leaves blocks unscheduled, which is
+    // an error.
+
+    void SortTopologically() {
+      auto& t = topology;
+      uint nBlocks = (uint) blocks.size();
+      vector<uint> pending = t.inDegree;
+      vector<uint> ready;
+      uint nSchedulable = 0;
+      t.schedulePos.assign(nBlocks, -1);
+      sources.clear();
+      for (uint id = 0; id < nBlocks; id++) {
+        if (blocks[id]->IsPort()) continue;
+        nSchedulable++;
+        if (pending[id] == 0) { sources.push_back(blocks[id]); }
+      }
+      for (uint id = nBlocks; id-- > 0; ) {
+        if (!blocks[id]->IsPort() && pending[id] == 0) { ready.push_back(id); }
+      }
+      schedule.clear();
+      schedule.reserve(nSchedulable);
+      while (!ready.empty()) {
+        uint id = ready.back();
+        ready.pop_back();
+        t.schedulePos[id] = (int) schedule.size();
+        schedule.push_back(id);
+        for (uint e = t.successorStart[id + 1]; e-- > t.successorStart[id]; ) {
+          uint next = t.successors[e];
+          if (--pending[next] == 0) { ready.push_back(next); }
+        }
       }
+      if (schedule.size() != nSchedulable) {
+        throw DspError("graph contains a feedback loop");
+      }
+      processing_order.clear();
+      processing_order.reserve(schedule.size());
+      for (auto id : schedule) { processing_order.push_back(blocks[id]); }
     }
 
     // When buffers have been allocated for an output pin, they need to be propagated
@@ -498,75 +1237,865 @@ namespace DspBlocks {
       }
     }
 
-    // When we are going to schedule a block for processing, it will need to allocate
-    // output buffers. We do this by using the buffer pool mechanism. A special case
-    // is an output port - we don't want to allocate buffers because we don't want an
-    // extra buffer copy operation. In this case, we just set the buffers of the out
-    // facing OutputPin identity of the output port to the buffers of the inward facing
-    // InputPin.
-
-    void AllocateOutputBuffers(DspInterface* block, vector<BufferSpec>& bufferPool) {
-      for (auto& pin : block->getOutputPins()) {
-        bool found_buffer = false;
-        auto ws = pin.wireSpec;
-        for (auto &bufSpec : bufferPool) {
-          if (bufSpec.free && bufSpec.isCompatible(ws)) {
-            pin.buffers = bufSpec.buffers;
-            pin.bufferId = bufSpec.Id;
-            bufSpec.free = false;
-            found_buffer = true;
+    // After all the processing order has been determined, we still need to forward the
+    // buffer pointers for the graph to outside the graph.
+    
+    void ConnectOutputPorts() {
+      for (auto& port : outputPorts) {
+        port.buffers = port.getInputPins()[0].buffers;
+      }
+    }
+
+    void DetermineProcessingOrder(vector<BufferSpec>& bufferPool) {
+      CompileTopology();
+      SortTopologically();
+      FuseChains();
+      ComputeLiveIntervals();
+      AssignBuffers(bufferPool);
+      AllocateBuffers(bufferPool);
+      ConnectOutputPorts();
+    }
+
+    // -------------------- Fusion -----------------------
+
+    /*
+     Find the chains of elementwise blocks in which each block's output goes only to the
+     next block, with the same wire spec, and make a FusedChain of each chain of two or
+     more. Every block but the last keeps its plan step, with no kernel, so the steps of
+     the plan still match processing_order. The signals read by the chain are read at the
+     last block's step, which runPos records for the allocator, and the signals inside
+     the chain get no buffers. The signals read by any block of the chain come earlier in
+     the schedule than that block, so they are all there by the time the chain runs.
+     */
+
+    void FuseChains() {
+      uint nSteps = (uint) schedule.size();
+      chains.clear();
+      chainOf.assign(nSteps, -1);
+      runPos.resize(nSteps);
+      for (uint step = 0; step < nSteps; step++) { runPos[step] = step; }
+      if (!fuseElementwise) return;
+
+      vector<ElementOp> ops(nSteps);
+      vector<char> fusible(nSteps, 0);
+      for (uint step = 0; step < nSteps; step++) {
+        auto block = processing_order[step];
+        auto& op = ops[step];
+        fusible[step] = block->getOutputPins().size() == 1 && block->getElementOp(op) &&
+                        block->getInputPins().size() == (op.kind == ElementOp::OpAdd ? 2 : 1);
+      }
+      vector<int> next(nSteps, -1);
+      vector<char> hasPrevious(nSteps, 0);
+      for (uint step = 0; step < nSteps; step++) {
+        if (!fusible[step]) continue;
+        auto& pin = processing_order[step]->getOutputPins()[0];
+        if (pin.sinks.size() != 1 || pin.sinks[0].block->IsPort()) continue;
+        uint sinkStep = (uint) topology.schedulePos[BlockId(pin.sinks[0].block)];
+        if (!fusible[sinkStep] || hasPrevious[sinkStep]) continue;   // one chain per block
+        if (processing_order[sinkStep]->getOutputPins()[0].wireSpec != pin.wireSpec) continue;
+        next[step] = (int) sinkStep;
+        hasPrevious[sinkStep] = 1;
+      }
+
+      for (uint head = 0; head < nSteps; head++) {
+        if (!fusible[head] || hasPrevious[head] || next[head] < 0) continue;
+        FusedChain chain;
+        OutputPin* previous = nullptr;
+        for (int step = (int) head; step >= 0; step = next[step]) {
+          auto block = processing_order[step];
+          auto& ins = block->getInputPins();
+          uint chainPin = 0;
+          for (uint i = 0; i < ins.size(); i++) {
+            if (&ins[i].source.GetOutputPin() == previous) { chainPin = i; }
+          }
+          if (previous == nullptr) { chain.inputs.push_back(&ins[chainPin].source.GetOutputPin()); }
+          ElementOp op = ops[step];
+          if (op.kind == ElementOp::OpAdd) {
+            op.input = (uint) chain.inputs.size();
+            chain.inputs.push_back(&ins[1 - chainPin].source.GetOutputPin());
           }
+          chain.ops.push_back(op);
+          chain.steps.push_back((uint) step);
+          previous = &block->getOutputPins()[0];
         }
-        if (!found_buffer) {
-          float **newBuffers = ws.AllocateBuffers();
-          pin.buffers = newBuffers;
-          auto newBufSpec = BufferSpec(ws, newBuffers);
-          pin.bufferId = newBufSpec.Id;
-          bufferPool.push_back(newBufSpec);
+        for (auto step : chain.steps) {
+          chainOf[step] = (int) chains.size();
+          runPos[step] = chain.steps.back();
         }
-        ConnectInputPinBuffers(pin);
+        chains.push_back(chain);
       }
     }
-    
-    // After all the processing order has been determined, we still need to forward the
-    // buffer pointers for the graph to outside the graph.
-    
-    void ConnectOutputPorts() {
-      for (auto block: blocks) {
-        OutputPort* port = dynamic_cast<OutputPort*>(block);
-        if (port != nullptr) {
-          port->buffers = port->getInputPins()[0].buffers;
+
+    bool IsFusedInner(int step) {
+      return step >= 0 && chainOf[step] >= 0 && chains[chainOf[step]].steps.back() != (uint) step;
+    }
+
+    // -------------------- Buffer Allocation -----------------------
+
+    // One interval per output pin, over the final schedule. Input ports come first, then
+    // the blocks in processing order, so the intervals come out ordered by their start.
+    // An output nobody reads still gets a buffer for the one step it is written in.
+
+    void ComputeLiveIntervals() {
+      int end = (int) schedule.size();
+      liveIntervals.clear();
+      pinIntervals.clear();
+      auto addPin = [&](OutputPin& pin, int start) {
+        int last = start;
+        for (auto& sink : pin.sinks) {
+          int pos = sink.block->IsPort() ? end : (int) runPos[topology.schedulePos[BlockId(sink.block)]];
+          last = max(last, pos);
+        }
+        pinIntervals[&pin] = (uint) liveIntervals.size();
+        liveIntervals.push_back({ start, last, &pin, 0, false, IsFusedInner(start) });
+      };
+      for (auto& port : inputPorts) { addPin(port.getOutputPins()[0], -1); }
+      for (int pos = 0; pos < end; pos++) {
+        for (auto& pin : processing_order[pos]->getOutputPins()) { addPin(pin, pos); }
+      }
+    }
+
+    // Interval graph coloring. Walk the intervals in order of their start and give each
+    // one a buffer whose previous signal ended before it starts, creating a new buffer
+    // only when no compatible one is free. A buffer read by a block is never also written
+    // by it, since an interval ending at a block's step is only released after that step.
+    // Greedy coloring in start order is optimal for interval graphs, so the pool ends up
+    // with exactly the peak number of signals of each shape that are live at once.
+    //
+    // The exception is a block which can process in place: if it is the last reader of
+    // the input it names, the output takes over the input's buffer, which then simply
+    // stays live until the output's interval ends. Without reuseBuffers, no buffer is ever
+    // released, so each signal gets its own.
+
+    void AssignBuffers(vector<BufferSpec>& bufferPool) {
+      typedef pair<int, uint> Expiry;   // end of an interval, and its index
+      priority_queue<Expiry, vector<Expiry>, greater<Expiry>> live;
+      unordered_map<uint64_t, vector<uint>> freeBuffers;
+      auto shape = [](const WireSpec& ws) { return ((uint64_t) ws.nChannels << 32) | ws.bufSize; };
+      bufferPool.clear();
+      for (uint i = 0; i < liveIntervals.size(); i++) {
+        auto& interval = liveIntervals[i];
+        if (interval.fused) continue;
+        while (!live.empty() && live.top().first < interval.start) {
+          auto& done = liveIntervals[live.top().second];
+          if (!done.handedOn) {
+            freeBuffers[shape(done.pin->wireSpec)].push_back(done.buffer);
+          }
+          live.pop();
+        }
+        auto& ws = interval.pin->wireSpec;
+        LiveInterval* source = reuseBuffers ? InPlaceSource(interval) : nullptr;
+        if (source != nullptr) {
+          interval.buffer = source->buffer;
+          source->handedOn = true;
+        } else {
+          auto& candidates = freeBuffers[shape(ws)];
+          if (candidates.empty()) {
+            interval.buffer = (uint) bufferPool.size();
+            bufferPool.push_back(BufferSpec(ws, nullptr));
+          } else {
+            interval.buffer = candidates.back();
+            candidates.pop_back();
+          }
         }
+        if (reuseBuffers) { live.push({ interval.end, i }); }
       }
     }
 
+    // The interval of the input whose buffer an output interval can take over, if any.
+    // The writing block has to allow it, has to be the input signal's last reader, and
+    // the buffer has to have the right shape and not have been taken over already.
+
+    LiveInterval* InPlaceSource(LiveInterval& interval) {
+      if (interval.start < 0 || chainOf[interval.start] >= 0) return nullptr;
+      auto block = processing_order[interval.start];
+      auto& outs = block->getOutputPins();
+      int inIdx = block->getInPlaceInput((uint) (interval.pin - &outs[0]));
+      if (inIdx < 0) return nullptr;
+      auto& inPin = block->getInputPins()[inIdx];
+      auto it = pinIntervals.find(&inPin.source.GetOutputPin());
+      if (it == pinIntervals.end()) return nullptr;
+      auto& source = liveIntervals[it->second];
+      if (source.end != interval.start || source.handedOn) return nullptr;
+      if (source.pin->wireSpec.nChannels != interval.pin->wireSpec.nChannels) return nullptr;
+      if (source.pin->wireSpec.bufSize != interval.pin->wireSpec.bufSize) return nullptr;
+      return &source;
+    }
+
+    // Create the buffers of the pool and hand them to the pins. They all come from the
+    // graph's arena, along with the buffers blocks reserve for themselves. Buffers for the
+    // input ports come from the pool like any other, so the host gets them from
+    // GetPortBuffers.
+
+    void AllocateBuffers(vector<BufferSpec>& bufferPool) {
+      arena.Reset();
+      for (auto& bufSpec : bufferPool) {
+        arena.Reserve(bufSpec.wireSpec, &bufSpec.buffers);
+      }
+      for (auto block : blocks) {
+        block->ReserveBuffers(arena);
+      }
+      arena.Commit();
+      ConnectPinBuffers();
+    }
+
+    void ConnectPinBuffers() {
+      auto& pool = *bufferPool;
+      for (auto& interval : liveIntervals) {
+        if (interval.fused) {
+          interval.pin->buffers = nullptr;
+          ConnectInputPinBuffers(*interval.pin);
+          continue;
+        }
+        auto& bufSpec = pool[interval.buffer];
+        interval.pin->buffers = bufSpec.buffers;
+        interval.pin->bufferId = bufSpec.Id;
+        ConnectInputPinBuffers(*interval.pin);
+      }
+      for (auto& port : inputPorts) {
+        port.buffers = port.getOutputPins()[0].buffers;
+      }
+    }
+
+    uint PeakBufferCount() { return bufferPool == nullptr ? 0 : (uint) bufferPool->size(); }
+
+    // Wire the graph's buffers into memory, for hosts which can't afford a page fault
+    // on the audio thread. Fails if the process may not lock that much memory.
+    bool LockBuffers() { return arena.Lock(); }
+
+    // -------------------- Incremental Recompilation -----------------------
+
     /*
-     find a block which is a source. It starts the list.
-     for each output, find what it is connected to. If we are the only input of that next block,
-     continue until we either reach a sink, or find a block with an input connection which hasn't
-     been processed yet. as we go, mark each processed connection
+     An editor makes lots of small changes to a big graph, and preparing the whole graph
+     again after each one takes too long. Once a graph has been prepared, Connect and
+     Disconnect keep a list of the edits, and Recompile brings the graph up to date with
+     a batch of them, redoing only what they affect:
+
+     - Wire specs are propagated from the pins of new connections, to the blocks whose
+       pins change, and on from there, rather than swept over the whole graph.
+     - The processing order is kept topological as each connection is added, with Pearce
+       and Kelly's algorithm, which only reorders blocks between the connection's ends.
+       Removing a connection never breaks the order. New blocks go at the end.
+     - Signals whose live intervals come out the same keep their buffers. The others are
+       fitted into gaps the kept ones leave, trying the buffer they had first, and the
+       pool only grows when there is none. The arena is only laid out again if the pool
+       grew or a new block reserved buffers of its own, in which case all buffers start
+       out zeroed, as after preparation.
+
+     The plan, demand and silence tables are rebuilt, which are single passes. Buffers
+     left empty, and the ordering's departure from the one preparation would have picked,
+     cost some memory until the next PrepareForOperation. Edits connect blocks which are
+     already flattened, don't get resamplers, and leave parameter ids as they were. Every
+     input has to be connected again by the end of the batch. Recompile must not run
+     while the graph does, and after it throws, the graph has to be prepared again.
+
+     When the arena is laid out again every buffer moves, the port buffers GetPortBuffers
+     handed out among them, so they have to be fetched again after each Recompile. The
+     executors copy the plan and the buffers when they are made, and a GraphHost runs
+     its graph on the audio thread, so Recompile throws while any of them is attached to
+     the graph; drop the executor, recompile, and make a new one.
      */
 
-    void DetermineProcessingOrder(DspInterface* block, vector<BufferSpec>& bufferPool) {
-      if (CanProcessBlock(block)) {
-        AllocateOutputBuffers(block, bufferPool);
-        MarkAsProcessed(block);
-        FreeInputBuffers(block, bufferPool);
-        for (auto& pin : block->getOutputPins()) {
+    void Recompile() {
+      if (!prepared) {
+        throw DspError("graph has to be prepared before it can be recompiled");
+      }
+      if (attachedExecutors > 0) {
+        throw DspError("graph can't be recompiled while an executor or host runs it");
+      }
+      if (edits.empty() && compiledBlocks == blocks.size()) return;
+      for (auto& edit : edits) {
+        if (!edit.connected && edit.dst.GetInputPin().source.IsEmpty()) {
+          throw DspError("unconnected input: " + PinName(edit.dst.block, true, edit.dst.pinIdx));
+        }
+      }
+      for (uint id = compiledBlocks; id < blocks.size(); id++) {
+        auto& pins = blocks[id]->getInputPins();
+        for (uint i = 0; i < pins.size(); i++) {
+          if (pins[i].source.IsEmpty()) { throw DspError("unconnected input: " + PinName(blocks[id], true, i)); }
+        }
+      }
+      PropagateEdits();
+      UpdateOrder();
+      CompileTopology();
+      FuseChains();
+      unordered_map<OutputPin*, LiveInterval> previous;
+      for (auto& interval : liveIntervals) { previous[interval.pin] = interval; }
+      ComputeLiveIntervals();
+      bool relayout = RecolorIntervals(previous);
+      BufferArena reserved;
+      for (uint id = compiledBlocks; id < blocks.size(); id++) { blocks[id]->ReserveBuffers(reserved); }
+      if (relayout || !reserved.reservations.empty()) {
+        AllocateBuffers(*bufferPool);
+        relayout = true;
+      } else {
+        ConnectPinBuffers();
+      }
+      ConnectOutputPorts();
+      RegisterParameters();
+      BuildPlan();
+      ComputeDemand();
+      BuildSilenceTables();
+      if (!relayout) { fill(bufferZeroed.begin(), bufferZeroed.end(), 0); }
+      edits.clear();
+      compiledBlocks = (uint) blocks.size();
+    }
+
+    // Each new connection hands the spec of whichever end has one to the other, and to
+    // the source's other sinks, and the blocks involved are queued as in PropagateSignals.
+
+    void PropagateEdits() {
+      vector<DspInterface*> work;
+      for (auto& edit : edits) {
+        auto& in = edit.dst.GetInputPin();
+        if (!edit.connected || in.source.block != edit.src.block || in.source.pinIdx != edit.src.pinIdx) continue;
+        auto& out = edit.src.GetOutputPin();
+        if (out.wireSpec.isEmpty() && !in.wireSpec.isEmpty()) { in.PropagateWireSpecs(); }
+        if (!out.wireSpec.isEmpty()) { out.PropagateWireSpecs(); }
+        work.push_back(edit.src.block);
+        work.push_back(edit.dst.block);
+        for (auto& sink : out.sinks) { work.push_back(sink.block); }
+      }
+      PropagateFrom(work);
+    }
+
+    void UpdateOrder() {
+      auto& pos = topology.schedulePos;
+      pos.resize(blocks.size(), -1);
+      orderMark.assign(blocks.size(), 0);
+      for (uint id = compiledBlocks; id < blocks.size(); id++) {
+        if (blocks[id]->IsPort()) continue;
+        pos[id] = (int) schedule.size();
+        schedule.push_back(id);
+      }
+      // The searches must only follow connections the order already accounts for, so
+      // each new connection is pending until it has been ordered. Connections are known
+      // by their input, and counted, since the same one may have been made twice.
+      auto isNew = [](Edit& edit) {
+        auto& in = edit.dst.GetInputPin();
+        return edit.connected && !edit.src.block->IsPort() && !edit.dst.block->IsPort() &&
+               in.source.block == edit.src.block && in.source.pinIdx == edit.src.pinIdx;
+      };
+      orderPending.clear();
+      for (auto& edit : edits) {
+        if (isNew(edit)) { orderPending[&edit.dst.GetInputPin()]++; }
+      }
+      for (auto& edit : edits) {
+        if (!isNew(edit) || --orderPending[&edit.dst.GetInputPin()] > 0) continue;
+        orderPending.erase(&edit.dst.GetInputPin());
+        InsertOrderedEdge(BlockId(edit.src.block), BlockId(edit.dst.block));
+      }
+      processing_order.resize(schedule.size());
+      for (uint step = 0; step < schedule.size(); step++) { processing_order[step] = blocks[schedule[step]]; }
+    }
+
+    // Pearce and Kelly: an edge from x to y needs nothing if y is already after x.
+    // Otherwise only the blocks between y and x can be out of order: those reachable from
+    // y, and those x is reachable from, searching no further than x and y. Reaching x
+    // from y means the edge closes a loop. The blocks x is reachable from then take the
+    // lowest of the positions both sets had, in the order they were in, and the ones
+    // reachable from y the rest.
+
+    void InsertOrderedEdge(uint x, uint y) {
+      auto& pos = topology.schedulePos;
+      int lb = pos[y], ub = pos[x];
+      if (lb > ub) return;
+      orderForward.clear();
+      orderBackward.clear();
+      orderForward.push_back(y);
+      orderMark[y] = 1;
+      for (size_t i = 0; i < orderForward.size(); i++) {
+        for (auto& pin : blocks[orderForward[i]]->getOutputPins()) {
           for (auto& sink : pin.sinks) {
-            auto& nextBlock = sink.block;
-            DetermineProcessingOrder(nextBlock, bufferPool);
+            if (sink.block->IsPort() || orderPending.count(&sink.GetInputPin())) continue;
+            uint w = BlockId(sink.block);
+            if (w == x) {
+              for (auto id : orderForward) { orderMark[id] = 0; }
+              throw DspError("graph contains a feedback loop");
+            }
+            if (!orderMark[w] && pos[w] < ub) {
+              orderMark[w] = 1;
+              orderForward.push_back(w);
+            }
+          }
+        }
+      }
+      orderBackward.push_back(x);
+      orderMark[x] = 1;
+      for (size_t i = 0; i < orderBackward.size(); i++) {
+        for (auto& pin : blocks[orderBackward[i]]->getInputPins()) {
+          if (pin.source.IsEmpty() || pin.source.block->IsPort() || orderPending.count(&pin)) continue;
+          uint w = BlockId(pin.source.block);
+          if (!orderMark[w] && pos[w] > lb) {
+            orderMark[w] = 1;
+            orderBackward.push_back(w);
           }
         }
       }
+      auto byPos = [&](uint a, uint b) { return pos[a] < pos[b]; };
+      sort(orderForward.begin(), orderForward.end(), byPos);
+      sort(orderBackward.begin(), orderBackward.end(), byPos);
+      orderSlots.clear();
+      for (auto id : orderBackward) { orderSlots.push_back(pos[id]); }
+      for (auto id : orderForward) { orderSlots.push_back(pos[id]); }
+      sort(orderSlots.begin(), orderSlots.end());
+      size_t slot = 0;
+      for (auto id : orderBackward) { pos[id] = orderSlots[slot++]; }
+      for (auto id : orderForward) { pos[id] = orderSlots[slot++]; }
+      for (auto id : orderBackward) { schedule[pos[id]] = id; orderMark[id] = 0; }
+      for (auto id : orderForward) { schedule[pos[id]] = id; orderMark[id] = 0; }
     }
 
-    void DetermineProcessingOrder(vector<BufferSpec>& bufferPool) {
-      FindSources();
-      for (auto& block : sources) {
-        DetermineProcessingOrder(block, bufferPool);
+    // Signals whose interval is what it was keep their buffer. For the others, a buffer
+    // of the right shape whose kept intervals leave a gap around theirs, or a new one.
+    // An edit which moves blocks moves the intervals of all the signals between, so a
+    // moved signal tries the buffer it had first, which usually still fits, rather than
+    // search the whole pool. Returns whether the pool grew.
+
+    bool RecolorIntervals(unordered_map<OutputPin*, LiveInterval>& previous) {
+      auto& pool = *bufferPool;
+      size_t oldSize = pool.size();
+      typedef pair<int, int> Span;
+      vector<vector<Span>> occupied(pool.size());   // kept intervals of each buffer, by start
+      vector<pair<uint, int>> changed;              // and the buffer each had, if any
+      for (uint i = 0; i < liveIntervals.size(); i++) {
+        auto& interval = liveIntervals[i];
+        if (interval.fused) continue;
+        auto it = previous.find(interval.pin);
+        if (it == previous.end() || it->second.fused) {
+          changed.push_back({ i, -1 });
+          continue;
+        }
+        if (it->second.start != interval.start || it->second.end != interval.end) {
+          changed.push_back({ i, (int) it->second.buffer });
+          continue;
+        }
+        interval.buffer = it->second.buffer;
+        interval.handedOn = it->second.handedOn;
+        occupied[interval.buffer].push_back({ interval.start, interval.end });
+      }
+      for (auto& spans : occupied) { sort(spans.begin(), spans.end()); }
+      for (auto& change : changed) {
+        auto& interval = liveIntervals[change.first];
+        auto& ws = interval.pin->wireSpec;
+        Span span { interval.start, interval.end };
+        auto fits = [&](uint b) {
+          auto& shape = pool[b].wireSpec;
+          if (shape.nChannels != ws.nChannels || shape.bufSize != ws.bufSize) return false;
+          auto& spans = occupied[b];
+          if (!reuseBuffers && !spans.empty()) return false;
+          auto after = lower_bound(spans.begin(), spans.end(), span);
+          if (after != spans.end() && after->first <= span.second) return false;
+          return after == spans.begin() || prev(after)->second < span.first;
+        };
+        uint buffer = (uint) pool.size();
+        if (change.second >= 0 && fits((uint) change.second)) {
+          buffer = (uint) change.second;
+        } else {
+          for (uint b = 0; b < pool.size(); b++) {
+            if (fits(b)) { buffer = b; break; }
+          }
+        }
+        if (buffer == pool.size()) {
+          pool.push_back(BufferSpec(ws, nullptr));
+          occupied.emplace_back();
+        }
+        interval.buffer = buffer;
+        interval.handedOn = false;
+        auto& spans = occupied[buffer];
+        spans.insert(upper_bound(spans.begin(), spans.end(), span), span);
+      }
+      return pool.size() > oldSize;
+    }
+
+    // -------------------- Execution Plan -----------------------
+
+    // Flatten processing_order into a contiguous array of kernels with their pin buffers
+    // resolved, so process() is a walk over the array with no virtual calls and no pin
+    // lookups. All the buffer pointers live in one array, sized up front so the entries
+    // can point into it. A fused chain runs at its last block's step, and the other
+    // blocks of the chain get steps with no kernel.
+
+    void BuildPlan() {
+      size_t nPins = 0;
+      for (auto block : processing_order) {
+        nPins += block->getInputPins().size() + block->getOutputPins().size();
+      }
+      for (auto& chain : chains) { nPins += chain.inputs.size(); }
+      planBuffers.assign(nPins, nullptr);
+      maxFrames = 0;
+      frameQuantum = 1;
+      plan.clear();
+      plan.reserve(processing_order.size());
+      float*** next = planBuffers.data();
+      for (uint step = 0; step < processing_order.size(); step++) {
+        auto block = processing_order[step];
+        PlanEntry entry;
+        entry.args = { next, next, 0, 0, 0, 0 };
+        if (IsFusedInner(step)) {
+          plan.push_back(entry);
+          continue;
+        }
+        auto& ins = block->getInputPins();
+        auto& outs = block->getOutputPins();
+        entry.args.inputs = next;
+        if (chainOf[step] >= 0) {
+          auto& chain = chains[chainOf[step]];
+          entry.kernel = { &FusedChain::Run, &chain };
+          for (auto pin : chain.inputs) { *next++ = pin->buffers; }
+        } else {
+          entry.kernel = block->getKernel();
+          for (auto& pin : ins) { *next++ = pin.buffers; }
+        }
+        entry.args.outputs = next;
+        for (auto& pin : outs) { *next++ = pin.buffers; }
+        Pin& pin = !outs.empty() ? static_cast<Pin&>(outs[0]) : static_cast<Pin&>(ins[0]);
+        entry.args.nFrames = pin.wireSpec.bufSize;
+        entry.args.firstChannel = 0;
+        entry.args.nChannels = pin.wireSpec.nChannels;
+        maxFrames = max(maxFrames, entry.args.nFrames);
+        plan.push_back(entry);
+      }
+      // blocks at a fraction of the graph's rate have to get whole frames
+      for (auto& entry : plan) {
+        if (entry.args.nFrames == 0) continue;
+        uint divisor = maxFrames / entry.args.nFrames;
+        uint a = frameQuantum, b = divisor;
+        while (b != 0) { uint t = a % b; a = b; b = t; }
+        frameQuantum = frameQuantum / a * divisor;
+      }
+      // the step whose kernel reads each parameter, which for a block inside a fused
+      // chain is the chain's
+      parameterSteps.resize(parameters.size());
+      for (uint id = 0; id < parameters.size(); id++) {
+        parameterSteps[id] = runPos[topology.schedulePos[BlockId(parameterBlocks[id])]];
+      }
+    }
+
+    // Run the whole plan a few times and keep each step's cheapest run in microseconds,
+    // which is the one least disturbed by everything else on the machine. Schedulers use
+    // this to balance work across threads. The blocks' state is saved first and restored
+    // afterwards (see DspInterface::SaveState), and buffers are no longer taken to be
+    // zeroed, so it can be called between cycles of a graph which is already running.
+    // Blocks which hold state without saving it are left advanced.
+
+    vector<double> MeasureStepCosts(uint nRuns) {
+      typedef chrono::steady_clock Clock;
+      vector<double> cost(plan.size(), nRuns == 0 ? 1 : 1e30);
+      vector<float> state;
+      for (auto block : blocks) { block->SaveState(state); }
+      for (uint run = 0; run < nRuns; run++) {
+        for (size_t step = 0; step < plan.size(); step++) {
+          auto& entry = plan[step];
+          if (entry.kernel.func == nullptr) {
+            cost[step] = 0;
+            continue;
+          }
+          auto start = Clock::now();
+          entry.kernel.func(entry.kernel.state, entry.args);
+          chrono::duration<double, micro> elapsed = Clock::now() - start;
+          cost[step] = min(cost[step], elapsed.count());
+        }
+      }
+      const float* saved = state.data();
+      for (auto block : blocks) { block->RestoreState(saved); }
+      fill(bufferZeroed.begin(), bufferZeroed.end(), 0);
+      return cost;
+    }
+
+    // -------------------- Demand -----------------------
+
+    /*
+     A block only has to run while something is listening to it. Each step of the plan
+     has a demand count: one for each active sink it is, or feeds directly through an
+     output port, plus one for each connection to a step which is itself demanded. A
+     step with no demand is skipped. Since everything upstream of a demanded step is
+     demanded too, a skipped step's outputs are never read.
+
+     When a sink is switched, only the counts which change are touched: a step whose
+     count goes from zero to one, or from one to zero, passes the change on to its
+     predecessors, and the walk stops wherever a count stays above zero. The schedule,
+     buffers and plan are left as they are. All sinks are active when the graph has just
+     been prepared. Sinks have to be switched between cycles, from the thread which runs
+     the graph.
+     */
+
+    void ComputeDemand() {
+      auto& t = topology;
+      uint nSteps = (uint) schedule.size();
+      predecessorStart.assign(nSteps + 1, 0);
+      for (auto id : schedule) {
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          predecessorStart[t.schedulePos[t.successors[e]] + 1]++;
+        }
+      }
+      for (uint step = 0; step < nSteps; step++) {
+        predecessorStart[step + 1] += predecessorStart[step];
+      }
+      predecessors.resize(predecessorStart[nSteps]);
+      vector<uint> fill(predecessorStart.begin(), predecessorStart.end() - 1);
+      for (uint step = 0; step < nSteps; step++) {
+        uint id = schedule[step];
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          predecessors[fill[t.schedulePos[t.successors[e]]]++] = step;
+        }
+      }
+
+      sinkActive.assign(blocks.size(), 1);
+      demand.assign(nSteps, 0);
+      for (auto& port : outputPorts) {
+        auto& src = port.getInputPins()[0].source;
+        if (!src.IsEmpty() && !src.block->IsPort()) {
+          demand[t.schedulePos[BlockId(src.block)]]++;
+        }
+      }
+      // successors come later in the plan, so walking it backwards sees them first
+      for (uint step = nSteps; step-- > 0; ) {
+        uint id = schedule[step];
+        if (blocks[id]->IsSink()) { demand[step]++; }
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          if (demand[t.schedulePos[t.successors[e]]] > 0) { demand[step]++; }
+        }
+      }
+      demandWork.reserve(nSteps);
+    }
+
+    void SetSinkActive(DspInterface* sink, bool active) {
+      if (demand.size() != schedule.size() || schedule.empty()) {
+        throw DspError("graph has not been prepared");
+      }
+      if (!sink->IsSink()) {
+        throw DspError("block is not a sink");
+      }
+      uint id = BlockId(sink);
+      if ((sinkActive[id] != 0) == active) return;
+      sinkActive[id] = active;
+      DspInterface* fed = sink;
+      if (sink->IsPort()) {
+        auto& src = sink->getInputPins()[0].source;
+        if (src.IsEmpty() || src.block->IsPort()) return;
+        fed = src.block;
+      }
+      ChangeDemand((uint) topology.schedulePos[BlockId(fed)], active ? 1 : -1);
+    }
+
+    void ChangeDemand(uint step, int delta) {
+      demandWork.clear();
+      demandWork.push_back(step);
+      while (!demandWork.empty()) {
+        uint s = demandWork.back();
+        demandWork.pop_back();
+        bool wasDemanded = demand[s] > 0;
+        demand[s] = (uint) ((int) demand[s] + delta);
+        if (wasDemanded == (demand[s] > 0)) continue;
+        for (uint e = predecessorStart[s]; e < predecessorStart[s + 1]; e++) {
+          demandWork.push_back(predecessors[e]);
+        }
+      }
+    }
+
+    bool IsDemanded(uint step) { return demand[step] > 0; }
+
+    // -------------------- Parameters -----------------------
+
+    /*
+     Control threads never write block parameters directly, since the audio thread may be
+     reading them. Instead each parameter gets an id when the graph is prepared, and
+     SetParameter queues the change in a lock-free ring, which any number of control
+     threads can push into. The audio thread drains the ring at the start of each cycle.
+     Neither side allocates or locks. When the ring is full, SetParameter returns false and
+     the change is dropped, which only happens if changes come faster than
+     ParameterQueueSize per buffer.
+
+     A change can carry a frame offset into the next buffer, for automation and note
+     events which have to land on a particular sample. process() sorts the cycle's changes
+     by step and offset, and runs the kernel of a block with changes pending in pieces,
+     applying each change between the piece before its offset and the one after. Kernels
+     already take a frame range, so blocks don't need to know about this, except those
+     which only have process(): they can't run part of a buffer, and get their changes at
+     the start of it. A change whose offset is past the end of the buffer lands after the
+     block has run. Changes for the same parameter at the same offset land in the order
+     they were queued. The executors apply every change at the start of the cycle, and
+     ignore offsets.
+     */
+
+    void RegisterParameters() {
+      parameters.clear();
+      parameterBlocks.clear();
+      for (auto block : blocks) {
+        block->getParameters(parameters);
+        parameterBlocks.resize(parameters.size(), block);
+      }
+      if (parameterChanges.Capacity() == 0) { parameterChanges.Init(ParameterQueueSize); }
+      parameterEvents.clear();
+      parameterEvents.reserve(ParameterQueueSize);
+    }
+
+    // The id of a parameter, by block and parameter name, or -1. For control threads,
+    // ahead of time: this is a search.
+    int ParameterId(DspInterface* block, const char* name) {
+      for (uint id = 0; id < parameters.size(); id++) {
+        if (parameterBlocks[id] == block && strcmp(parameters[id].name, name) == 0) return (int) id;
+      }
+      return -1;
+    }
+
+    int ParameterId(const char* instanceName, const char* name) {
+      for (uint id = 0; id < parameters.size(); id++) {
+        if (strcmp(parameterBlocks[id]->getInstanceName(), instanceName) == 0 &&
+            strcmp(parameters[id].name, name) == 0) return (int) id;
+      }
+      return -1;
+    }
+
+    bool SetParameter(uint id, float value, uint offset = 0) {
+      if (id >= parameters.size()) {
+        throw DspError("no such parameter");
+      }
+      return parameterChanges.Push({ id, value, offset });
+    }
+
+    // Called at the start of each cycle by the executors
+    void ApplyParameterChanges() {
+      ParameterChange change;
+      while (parameterChanges.Pop(change)) { *parameters[change.id].value = change.value; }
+    }
+
+    // Called at the start of each cycle by process(). Changes at offset 0 are applied
+    // right away, the rest are sorted into parameterEvents. The ring is drained no
+    // further than parameterEvents has room for, so this never allocates. Returns how
+    // many changes were taken from the ring.
+    uint QueueParameterEvents() {
+      parameterEvents.clear();
+      ParameterChange change;
+      uint nChanges = 0;
+      while (parameterEvents.size() < parameterEvents.capacity() && parameterChanges.Pop(change)) {
+        nChanges++;
+        if (change.offset == 0) {
+          *parameters[change.id].value = change.value;
+          continue;
+        }
+        // offsets are in frames at the graph's rate, events in the block's own
+        uint step = parameterSteps[change.id];
+        uint offset = (uint) ((uint64_t) change.offset * plan[step].args.nFrames / maxFrames);
+        ParameterEvent event { step, offset, change.id, change.value };
+        // insertion sort: there are few changes per cycle, and it keeps queue order for ties
+        size_t pos = parameterEvents.size();
+        parameterEvents.push_back(event);
+        for (; pos > 0; pos--) {
+          auto& prev = parameterEvents[pos - 1];
+          if (prev.step < event.step || (prev.step == event.step && prev.offset <= event.offset)) break;
+          parameterEvents[pos] = prev;
+        }
+        parameterEvents[pos] = event;
+      }
+      return nChanges;
+    }
+
+    void ApplyParameterEvent(const ParameterEvent& event) {
+      *parameters[event.id].value = event.value;
+    }
+
+    // Runs a step's kernel over frames 0 .. nFrames - 1 with parameterEvents[first .. end)
+    // applied at their offsets
+    void RunSplitAtEvents(PlanEntry& entry, uint nFrames, uint first, uint end) {
+      auto& kernel = entry.kernel;
+      if (kernel.func == &DspInterface::ProcessKernel) {
+        for (uint e = first; e < end; e++) { ApplyParameterEvent(parameterEvents[e]); }
+        kernel.func(kernel.state, entry.args);
+        return;
+      }
+      KernelArgs args = entry.args;
+      uint frame = 0;
+      for (uint e = first; e <= end; e++) {
+        uint split = e < end ? min(parameterEvents[e].offset, nFrames) : nFrames;
+        if (split > frame) {
+          args.firstFrame = frame;
+          args.nFrames = split - frame;
+          kernel.func(kernel.state, args);
+          frame = split;
+        }
+        if (e < end) { ApplyParameterEvent(parameterEvents[e]); }
       }
-      ConnectOutputPorts();
+    }
+
+    // -------------------- Silence -----------------------
+
+    /*
+     Most signals are silent most of the time, so the graph tracks which are. Each cycle,
+     every signal gets a state, worked out from the host's say for the input ports and
+     from getOutputState for blocks which track silence. A block which says its outputs
+     are silent isn't run, so its output buffers keep whatever was last written to them.
+     They are only zeroed when a block which does run reads them, or when they leave
+     the graph through an output port, and a buffer which has been zeroed isn't zeroed
+     again until something else is written to it. Whether a buffer holds zeros is kept
+     per buffer rather than per signal, since with reuseBuffers several signals share a
+     buffer over the cycle.
+
+     Only process() tracks silence. The parallel executors run every demanded block.
+     */
+
+    void BuildSilenceTables() {
+      uint nSteps = (uint) processing_order.size();
+      stepSignalStart.assign(nSteps + 1, 0);
+      stepSignals.clear();
+      stepInputCount.assign(nSteps, 0);
+      stepTracksSilence.assign(nSteps, 0);
+      for (uint step = 0; step < nSteps; step++) {
+        auto block = processing_order[step];
+        if (IsFusedInner(step)) {
+          stepSignalStart[step + 1] = (uint) stepSignals.size();
+          continue;
+        }
+        if (chainOf[step] >= 0) {
+          // a fused chain reads the inputs of all its blocks, and tracks silence if they all do
+          auto& chain = chains[chainOf[step]];
+          for (auto pin : chain.inputs) { stepSignals.push_back(pinIntervals[pin]); }
+          stepInputCount[step] = (uint) chain.inputs.size();
+          stepTracksSilence[step] = 1;
+          for (auto s : chain.steps) {
+            if (!processing_order[s]->TracksSilence()) { stepTracksSilence[step] = 0; }
+          }
+        } else {
+          for (auto& pin : block->getInputPins()) {
+            stepSignals.push_back(pinIntervals[&pin.source.GetOutputPin()]);
+          }
+          stepInputCount[step] = (uint) block->getInputPins().size();
+          stepTracksSilence[step] = block->TracksSilence();
+        }
+        for (auto& pin : block->getOutputPins()) {
+          stepSignals.push_back(pinIntervals[&pin]);
+        }
+        stepSignalStart[step + 1] = (uint) stepSignals.size();
+      }
+      inputPortSignals.clear();
+      for (auto& port : inputPorts) { inputPortSignals.push_back(pinIntervals[&port.getOutputPins()[0]]); }
+      outputPortSignals.clear();
+      for (auto& port : outputPorts) {
+        outputPortSignals.push_back(pinIntervals[&port.getInputPins()[0].source.GetOutputPin()]);
+      }
+      signalStates.assign(liveIntervals.size(), SignalLive);
+      bufferZeroed.assign(bufferPool->size(), 1);   // the arena starts out zeroed
+      inputPortStates.assign(inputPorts.size(), SignalLive);
+    }
+
+    // The host can tell the graph that an input will be silent (or constant) this
+    // cycle, in which case it doesn't need to fill the input's buffer. This holds until
+    // it says otherwise.
+    void SetInputState(uint portIdx, SignalState state) { inputPortStates[portIdx] = state; }
+    void SetInputSilent(uint portIdx, bool silent) {
+      SetInputState(portIdx, silent ? SignalSilent : SignalLive);
+    }
+
+    SignalState GetOutputState(uint portIdx) { return signalStates[outputPortSignals[portIdx]]; }
+
+    void ZeroSignal(uint signal) {
+      uint buffer = liveIntervals[signal].buffer;
+      if (bufferZeroed[buffer]) return;
+      auto& ws = liveIntervals[signal].pin->wireSpec;
+      float** bufs = (*bufferPool)[buffer].buffers;
+      for (uint ch = 0; ch < ws.nChannels; ch++) { memset(bufs[ch], 0, sizeof(float) * ws.bufSize); }
+      bufferZeroed[buffer] = 1;
     }
 
     void Describe() {
@@ -593,6 +2122,9 @@ namespace DspBlocks {
         }
       }
 
+      cout << "\n";
+      cout << "buffers: " << PeakBufferCount() << " for " << liveIntervals.size() << " signals\n";
+      cout << "fused chains: " << chains.size() << "\n";
       cout << "\n";
       cout << "processing_order \n";
       cout << "\n";
@@ -605,8 +2137,83 @@ namespace DspBlocks {
       for (auto& block: blocks) { block->init(); }
     }
 
-    void process() override {
-      for (auto& block: processing_order) { block->process(); }
+    void process() override { process(maxFrames); }
+
+    /*
+     Host callbacks don't always come with the same number of frames. process(nFrames)
+     runs the graph over just the first nFrames frames of every buffer, which may be
+     anything up to the buffer size the graph was prepared with: each kernel is simply
+     handed the shorter range, so nothing is reallocated, padded or delayed. Frames past
+     nFrames in the port buffers are left as they were. Blocks which only have process()
+     can't run part of a buffer and always process all of it. In a multi-rate graph,
+     blocks at a fraction of the rate get that fraction of the frames, so nFrames has to
+     be a multiple of the largest rate divisor.
+     */
+
+    void process(uint nFrames) {
+      if (nFrames > maxFrames) {
+        throw DspError("more frames than the graph was prepared for");
+      }
+      if (nFrames % frameQuantum != 0) {
+        throw DspError("frame count isn't a multiple of the graph's largest rate divisor");
+      }
+      quiet = QueueParameterEvents() == 0;
+      uint nEvents = (uint) parameterEvents.size();
+      uint nextEvent = 0;
+      for (uint i = 0; i < inputPorts.size(); i++) {
+        uint signal = inputPortSignals[i];
+        signalStates[signal] = inputPortStates[i];
+        if (inputPortStates[i] != SignalSilent) { quiet = false; }
+        bufferZeroed[liveIntervals[signal].buffer] = 0;   // the host may have written to it
+      }
+      for (uint step = 0; step < plan.size(); step++) {
+        auto& entry = plan[step];
+        // changes for blocks which weren't run still land, at the end of their step
+        while (nextEvent < nEvents && parameterEvents[nextEvent].step < step) {
+          ApplyParameterEvent(parameterEvents[nextEvent++]);
+        }
+        uint endEvent = nextEvent;
+        while (endEvent < nEvents && parameterEvents[endEvent].step == step) { endEvent++; }
+        if (demand[step] == 0 || entry.kernel.func == nullptr) continue;
+        uint frames = entry.args.nFrames == maxFrames ? nFrames : nFrames * entry.args.nFrames / maxFrames;
+        uint* ins = &stepSignals[stepSignalStart[step]];
+        uint* outs = ins + stepInputCount[step];
+        uint* end = &stepSignals[0] + stepSignalStart[step + 1];
+        SignalState state = SignalLive;
+        // a block with changes pending may not stay silent past them
+        if (stepTracksSilence[step] && endEvent == nextEvent) {
+          SignalState inputs = SignalSilent;
+          for (uint* s = ins; s < outs; s++) { inputs = max(inputs, signalStates[*s]); }
+          state = chainOf[step] >= 0 ? chains[chainOf[step]].OutputState(processing_order, inputs, frames) :
+                                       processing_order[step]->getOutputState(inputs, frames);
+        }
+        if (state == SignalSilent) {
+          for (uint* s = outs; s < end; s++) { signalStates[*s] = SignalSilent; }
+          continue;
+        }
+        for (uint* s = ins; s < outs; s++) {
+          if (signalStates[*s] == SignalSilent) { ZeroSignal(*s); }
+        }
+        quiet = false;
+        if (endEvent == nextEvent && frames == entry.args.nFrames) {
+          entry.kernel.func(entry.kernel.state, entry.args);
+        } else if (endEvent == nextEvent) {
+          KernelArgs args = entry.args;
+          args.nFrames = frames;
+          entry.kernel.func(entry.kernel.state, args);
+        } else {
+          RunSplitAtEvents(entry, frames, nextEvent, endEvent);
+          nextEvent = endEvent;
+        }
+        for (uint* s = outs; s < end; s++) {
+          signalStates[*s] = state;
+          bufferZeroed[liveIntervals[*s].buffer] = 0;
+        }
+      }
+      while (nextEvent < nEvents) { ApplyParameterEvent(parameterEvents[nextEvent++]); }
+      for (uint signal : outputPortSignals) {
+        if (signalStates[signal] == SignalSilent) { ZeroSignal(signal); }
+      }
     }
 
   };
@@ -0,0 +1,175 @@
+//
+//  GraphHost.hpp
+//
+//  Runs a graph on the audio thread, and replaces it with a new one without a glitch.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+
+#include <atomic>
+#include <memory>
+
+namespace DspBlocks {
+
+  /*
+   Changing the topology of a graph means building a new one and preparing it, which
+   allocates. A GraphHost lets a control thread do that while the audio thread carries on
+   with the old graph, and then hands the new graph over at a buffer boundary.
+
+   Replace prepares the new graph on the calling thread, and pairs each of its blocks
+   with the block of the same class and instance name in the graph it replaces, if there
+   is one. It then publishes the replacement through an atomic pointer. At the start of
+   the next buffer, the audio thread picks it up, has each paired block copy the state of
+   its counterpart (CopyStateFrom), and switches over. With a crossfade, the old graph
+   keeps running alongside the new one for that many frames while the output fades from
+   one to the other. The old graph is then handed back through a second atomic pointer,
+   and the control thread deletes it the next time it calls Replace or CollectRetired.
+   The audio thread never allocates, frees or waits.
+
+   One swap is in flight at a time: Replace returns false while the previous one hasn't
+   been picked up yet, and the audio thread doesn't pick up a new one until the last
+   retired graph has been collected. Replace and CollectRetired are for one control
+   thread, process for the audio thread. The host owns the graphs it is given. Each graph
+   is run through its first input and output port, with the host's wire spec, for
+   however many frames up to its buffer size the host callback brings.
+   */
+
+  struct GraphHost {
+
+    struct Swap {
+      GraphBase* graph = nullptr;
+      GraphBase* previous = nullptr;
+      vector<pair<DspInterface*, DspInterface*>> carryOver;   // new block, old block
+      uint crossfadeFrames = 0;
+    };
+
+    WireSpec wireSpec;
+    atomic<Swap*> pending { nullptr };
+    atomic<Swap*> retired { nullptr };
+    GraphBase* latest = nullptr;      // control thread: the graph swaps are matched against
+
+    // audio thread only
+    GraphBase* current = nullptr;
+    Swap* fading = nullptr;           // whose previous graph is being faded out
+    uint fadePos = 0;
+    BufferArena arena;
+    float** fadeBuffers = nullptr;
+
+    GraphHost(WireSpec ws) : wireSpec(ws) {
+      arena.Reserve(ws, &fadeBuffers);
+      arena.Commit();
+    }
+
+    GraphHost(const GraphHost&) = delete;
+
+    // only once the audio thread has stopped calling process
+    ~GraphHost() {
+      CollectRetired();
+      Swap* swap = pending.exchange(nullptr);
+      if (swap != nullptr) { delete swap->graph; delete swap; }
+      if (fading != nullptr) { delete fading->previous; delete fading; }
+      delete current;
+    }
+
+    // ------------------ Control Thread --------------------
+
+    bool Replace(GraphBase* graph, uint crossfadeFrames = 0) {
+      CollectRetired();
+      if (pending.load(memory_order_acquire) != nullptr) return false;
+      graph->PrepareForOperation(wireSpec, true);
+      graph->InitBlocks();
+      graph->attachedExecutors++;     // the host owns it from here on, and never lets go
+      unique_ptr<Swap> swap(new Swap());
+      swap->graph = graph;
+      swap->crossfadeFrames = crossfadeFrames;
+      if (latest != nullptr) { MatchBlocks(*swap, *latest); }
+      pending.store(swap.release(), memory_order_release);
+      latest = graph;
+      return true;
+    }
+
+    // Blocks are matched by class and instance name. Blocks without a name are never
+    // matched, since there is no telling which of them is which.
+    void MatchBlocks(Swap& swap, GraphBase& old) {
+      unordered_map<string, DspInterface*> oldBlocks;
+      for (auto block : old.blocks) {
+        if (block->IsPort() || *block->getInstanceName() == 0) continue;
+        oldBlocks[string(block->getClassName()) + "/" + block->getInstanceName()] = block;
+      }
+      for (auto block : swap.graph->blocks) {
+        if (block->IsPort() || *block->getInstanceName() == 0) continue;
+        auto it = oldBlocks.find(string(block->getClassName()) + "/" + block->getInstanceName());
+        if (it != oldBlocks.end()) { swap.carryOver.push_back({ block, it->second }); }
+      }
+    }
+
+    void CollectRetired() {
+      Swap* swap = retired.exchange(nullptr, memory_order_acq_rel);
+      if (swap == nullptr) return;
+      delete swap->previous;
+      delete swap;
+    }
+
+    // ------------------ Audio Thread --------------------
+
+    void TakePendingSwap() {
+      if (fading != nullptr || retired.load(memory_order_acquire) != nullptr) return;
+      Swap* swap = pending.exchange(nullptr, memory_order_acq_rel);
+      if (swap == nullptr) return;
+      for (auto& match : swap->carryOver) { match.first->CopyStateFrom(*match.second); }
+      swap->previous = current;
+      current = swap->graph;
+      if (swap->previous != nullptr && swap->crossfadeFrames > 0) {
+        fading = swap;
+        fadePos = 0;
+      } else {
+        retired.store(swap, memory_order_release);
+      }
+    }
+
+    void RunGraph(GraphBase& graph, float** in, float** out, uint nFrames) {
+      float** iBufs; float** oBufs;
+      graph.GetPortBuffers(iBufs, oBufs);
+      for (uint ch = 0; ch < wireSpec.nChannels; ch++) {
+        copy(in[ch], in[ch] + nFrames, iBufs[ch]);
+      }
+      graph.process(nFrames);
+      for (uint ch = 0; ch < wireSpec.nChannels; ch++) {
+        copy(oBufs[ch], oBufs[ch] + nFrames, out[ch]);
+      }
+    }
+
+    void process(float** in, float** out) { process(in, out, wireSpec.bufSize); }
+
+    void process(float** in, float** out, uint nFrames) {
+      TakePendingSwap();
+      if (current == nullptr) {
+        for (uint ch = 0; ch < wireSpec.nChannels; ch++) {
+          fill(out[ch], out[ch] + nFrames, 0.0f);
+        }
+        return;
+      }
+      RunGraph(*current, in, out, nFrames);
+      if (fading == nullptr) return;
+
+      // linear crossfade from the previous graph's output to the new one's
+      RunGraph(*fading->previous, in, fadeBuffers, nFrames);
+      float length = (float) fading->crossfadeFrames;
+      for (uint ch = 0; ch < wireSpec.nChannels; ch++) {
+        for (uint i = 0; i < nFrames; i++) {
+          float mix = min(1.0f, (fadePos + i) / length);
+          out[ch][i] = mix * out[ch][i] + (1 - mix) * fadeBuffers[ch][i];
+        }
+      }
+      fadePos += nFrames;
+      if (fadePos >= fading->crossfadeFrames) {
+        retired.store(fading, memory_order_release);
+        fading = nullptr;
+      }
+    }
+
+  };
+
+}
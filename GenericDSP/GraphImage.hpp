@@ -0,0 +1,513 @@
+//
+//  GraphImage.hpp
+//
+//  Saves a prepared graph as a binary image, and loads one ready to run without
+//  preparing it again.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <type_traits>
+
+namespace DspBlocks {
+
+  /*
+   Building a big graph from code and preparing it takes a while, and so may the tables
+   its blocks compute in init(). SaveGraphImage writes a prepared top level graph to a
+   file, and LoadGraphImage maps the file and gives back a graph that is ready to run,
+   without propagating wire specs, sorting blocks or coloring buffers again. The image
+   holds, in order:
+
+   - a header: the magic number, the format version, a byte order mark, the graph's wire
+     spec, its number of ports and its preparation options
+   - every block, in the order of the graph's block ids: its class and instance names,
+     its rate divisor, what its SaveConfig wrote, its parameter values and its tables
+   - every block's pins: their wire specs, and the sinks of each output
+   - the schedule, as block ids
+   - the buffer pool, and the buffer each signal was given
+
+   Blocks are made again by the maker registered for their class name, see RegisterBlock.
+   After that, loading only redoes the single passes over the graph: the adjacency,
+   fusion and live intervals, to which the saved buffers are attached again, then the
+   plan, demand and silence tables. Blocks then get init(), as after preparation, so
+   state they don't keep in parameters or tables starts afresh.
+
+   Values are stored as they are in memory, so an image can only be read on the kind of
+   machine which wrote it, which the byte order mark and the size of the wire spec check.
+   Images of another version are rejected rather than converted; the version has to be
+   bumped whenever the layout changes.
+   */
+
+  static const char GraphImageMagic[4] = { 'D', 'S', 'P', 'G' };
+  static const uint GraphImageVersion = 1;
+  static const uint32_t GraphImageByteOrder = 0x01020304;
+
+  struct ImageWriter {
+    vector<char> bytes;
+
+    void WriteBytes(const void* data, size_t size) {
+      auto p = static_cast<const char*>(data);
+      bytes.insert(bytes.end(), p, p + size);
+    }
+
+    template <class T>
+    void Write(const T& value) { WriteBytes(&value, sizeof(T)); }
+
+    void WriteBool(bool value) { Write((uint8_t) value); }
+
+    void WriteString(const string& str) {
+      Write((uint) str.size());
+      WriteBytes(str.data(), str.size());
+    }
+
+    void WriteFloats(const vector<float>& values) {
+      Write((uint) values.size());
+      WriteBytes(values.data(), values.size() * sizeof(float));
+    }
+  };
+
+  // Reads an image from memory, and throws rather than read past its end
+  struct ImageReader {
+    const char* pos;
+    const char* end;
+
+    ImageReader(const char* data, size_t size) : pos(data), end(data + size) {}
+
+    const char* Take(size_t size) {
+      if ((size_t) (end - pos) < size) {
+        throw DspError("graph image is truncated");
+      }
+      const char* p = pos;
+      pos += size;
+      return p;
+    }
+
+    // Not for bools, which can't hold just any byte: see ReadBool
+    template <class T>
+    T Read() {
+      static_assert(!is_same<T, bool>::value, "bools are read with ReadBool");
+      T value;
+      memcpy(&value, Take(sizeof(T)), sizeof(T));
+      return value;
+    }
+
+    bool ReadBool() {
+      uint8_t value = Read<uint8_t>();
+      if (value > 1) {
+        throw DspError("graph image holds a bad flag");
+      }
+      return value != 0;
+    }
+
+    string ReadString() {
+      uint size = Read<uint>();
+      return string(Take(size), size);
+    }
+
+    void ReadFloats(vector<float>& values) {
+      uint size = Read<uint>();
+      const char* data = Take(size * sizeof(float));   // before a bad size can allocate
+      values.resize(size);
+      memcpy(values.data(), data, size * sizeof(float));
+    }
+
+    bool AtEnd() { return pos == end; }
+  };
+
+  // ------------------ Block Registry --------------------
+
+  // Makes a block of one class from what its SaveConfig wrote. Blocks without a config
+  // can use MakeBlock<their type>.
+  typedef DspBase* (*BlockMaker)(ImageReader& config);
+
+  template <class Block>
+  DspBase* MakeBlock(ImageReader& config) { return new Block(); }
+
+  // The makers by class name. The standard blocks are registered in GenericDSP.cpp, and
+  // others have to be registered before a graph using them is saved or loaded.
+  unordered_map<string, BlockMaker>& BlockMakers();
+
+  inline void RegisterBlock(const string& className, BlockMaker maker) {
+    BlockMakers()[className] = maker;
+  }
+
+  // A graph loaded from an image, which owns all its blocks
+  struct ImageGraph : GraphBase {
+    WireSpec wireSpec;
+
+    ImageGraph(uint nInputPorts, uint nOutputPorts, WireSpec ws) :
+            GraphBase(nInputPorts, nOutputPorts), wireSpec(ws) {}
+
+    WireSpec getInputWireSpec(uint pinIdx) override { return wireSpec; }
+    WireSpec getOutputWireSpec(uint pinIdx) override { return wireSpec; }
+    bool updateWireSpecs() override { return false; }
+  };
+
+  // ------------------ Saving --------------------
+
+  // Blocks are told apart from ports by a kind, followed by what it takes to make them
+  enum ImageBlockKind : uint8_t { ImageBlock, ImageInputPort, ImageOutputPort };
+
+  inline void WriteImageBlock(ImageWriter& out, GraphBase& graph, DspInterface* block) {
+    if (block->IsPort()) {
+      for (uint i = 0; i < graph.inputPorts.size(); i++) {
+        if (block == &graph.inputPorts[i]) { out.Write(ImageInputPort); out.Write(i); return; }
+      }
+      for (uint i = 0; i < graph.outputPorts.size(); i++) {
+        if (block == &graph.outputPorts[i]) { out.Write(ImageOutputPort); out.Write(i); return; }
+      }
+      throw DspError("graph has a port which isn't its own");
+    }
+    string className = block->getClassName();
+    if (BlockMakers().count(className) == 0) {
+      throw DspError("can't save a block of an unregistered class: " + className);
+    }
+    out.Write(ImageBlock);
+    out.WriteString(className);
+    out.WriteString(block->getInstanceName());
+    out.Write(block->getRateDivisor());
+
+    ImageWriter config;
+    block->SaveConfig(config);
+    out.Write((uint) config.bytes.size());
+    out.WriteBytes(config.bytes.data(), config.bytes.size());
+
+    vector<ParameterSpec> params;
+    block->getParameters(params);
+    out.Write((uint) params.size());
+    for (auto& param : params) { out.Write(*param.value); }
+
+    vector<TableSpec> tables;
+    block->getTables(tables);
+    out.Write((uint) tables.size());
+    for (auto& table : tables) { out.WriteFloats(*table.values); }
+  }
+
+  inline void WriteImagePins(ImageWriter& out, GraphBase& graph, DspInterface* block) {
+    auto& ins = block->getInputPins();
+    auto& outs = block->getOutputPins();
+    out.Write((uint) ins.size());
+    out.Write((uint) outs.size());
+    for (auto& pin : ins) { out.Write(pin.wireSpec); }
+    for (auto& pin : outs) {
+      out.Write(pin.wireSpec);
+      out.Write((uint) pin.sinks.size());
+      for (auto& sink : pin.sinks) {
+        out.Write(graph.BlockId(sink.block));
+        out.Write(sink.pinIdx);
+      }
+    }
+  }
+
+  inline ImageWriter WriteGraphImage(GraphBase& graph) {
+    if (!graph.prepared || !graph.topLevel) {
+      throw DspError("only a prepared top level graph can be saved");
+    }
+    if (!graph.edits.empty() || graph.compiledBlocks != graph.blocks.size()) {
+      throw DspError("graph has edits which haven't been recompiled");
+    }
+    ImageWriter out;
+    out.WriteBytes(GraphImageMagic, sizeof(GraphImageMagic));
+    out.Write(GraphImageVersion);
+    out.Write(GraphImageByteOrder);
+    out.Write((uint) sizeof(WireSpec));
+    out.Write(graph.inputPorts[0].sharedWireSpec);
+    out.Write((uint) graph.inputPorts.size());
+    out.Write((uint) graph.outputPorts.size());
+    out.WriteBool(graph.reuseBuffers);
+    out.WriteBool(graph.fuseElementwise);
+
+    out.Write((uint) graph.blocks.size());
+    for (auto block : graph.blocks) { WriteImageBlock(out, graph, block); }
+    for (auto block : graph.blocks) { WriteImagePins(out, graph, block); }
+
+    out.Write((uint) graph.schedule.size());
+    for (auto id : graph.schedule) { out.Write(id); }
+
+    auto& pool = *graph.bufferPool;
+    out.Write((uint) pool.size());
+    for (auto& bufSpec : pool) { out.Write(bufSpec.wireSpec); }
+    out.Write((uint) graph.liveIntervals.size());
+    for (auto& interval : graph.liveIntervals) {
+      out.Write(interval.buffer);
+      out.WriteBool(interval.handedOn);
+    }
+    return out;
+  }
+
+  inline void SaveGraphImage(GraphBase& graph, const char* path) {
+    ImageWriter image = WriteGraphImage(graph);
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+      throw DspError(string("can't create graph image ") + path);
+    }
+    size_t written = fwrite(image.bytes.data(), 1, image.bytes.size(), file);
+    if (fclose(file) != 0 || written != image.bytes.size()) {
+      throw DspError(string("can't write graph image ") + path);
+    }
+  }
+
+  // ------------------ Loading --------------------
+
+  inline void ReadImageBlock(ImageReader& in, ImageGraph& graph) {
+    auto kind = in.Read<ImageBlockKind>();
+    if (kind != ImageBlock) {
+      uint idx = in.Read<uint>();
+      if (kind > ImageOutputPort ||
+          idx >= (kind == ImageInputPort ? graph.inputPorts.size() : graph.outputPorts.size())) {
+        throw DspError("graph image has a port the graph doesn't");
+      }
+      if (kind == ImageInputPort) {
+        graph.AddBlock(&graph.inputPorts[idx]);
+      } else {
+        graph.AddBlock(&graph.outputPorts[idx]);
+      }
+      return;
+    }
+    string className = in.ReadString();
+    auto maker = BlockMakers().find(className);
+    if (maker == BlockMakers().end()) {
+      throw DspError("graph image has a block of an unregistered class: " + className);
+    }
+    string instanceName = in.ReadString();
+    uint rateDivisor = in.Read<uint>();
+    uint configSize = in.Read<uint>();
+    ImageReader config(in.Take(configSize), configSize);
+    DspBase* block = maker->second(config);
+    graph.ownedBlocks.emplace_back(block);
+    graph.AddBlock(block);
+    if (!config.AtEnd()) {
+      throw DspError("graph image has a config its block didn't read: " + className);
+    }
+    block->SetInstanceName(instanceName);
+    block->SetRateDivisor(rateDivisor);
+
+    vector<ParameterSpec> params;
+    block->getParameters(params);
+    if (in.Read<uint>() != params.size()) {
+      throw DspError("graph image doesn't have the parameters of its block: " + className);
+    }
+    for (auto& param : params) { *param.value = in.Read<float>(); }
+
+    vector<TableSpec> tables;
+    block->getTables(tables);
+    if (in.Read<uint>() != tables.size()) {
+      throw DspError("graph image doesn't have the tables of its block: " + className);
+    }
+    for (auto& table : tables) {
+      in.ReadFloats(*table.values);
+      if (!table.values->empty() && table.values->size() != table.size) {
+        throw DspError(string("graph image has a table of the wrong size: ") + className + " " + table.name);
+      }
+    }
+  }
+
+  inline void ReadImagePins(ImageReader& in, ImageGraph& graph, DspInterface* block) {
+    auto& ins = block->getInputPins();
+    auto& outs = block->getOutputPins();
+    uint nIns = in.Read<uint>();
+    uint nOuts = in.Read<uint>();
+    if (nIns != ins.size() || nOuts != outs.size()) {
+      throw DspError(string("graph image doesn't have the pins of its block: ") + block->getClassName());
+    }
+    for (auto& pin : ins) { pin.wireSpec = in.Read<WireSpec>(); }
+    for (uint pinIdx = 0; pinIdx < nOuts; pinIdx++) {
+      outs[pinIdx].wireSpec = in.Read<WireSpec>();
+      uint nSinks = in.Read<uint>();
+      for (uint s = 0; s < nSinks; s++) {
+        uint dst = in.Read<uint>();
+        uint dstPin = in.Read<uint>();
+        if (dst >= graph.blocks.size() || dstPin >= graph.blocks[dst]->getInputPins().size()) {
+          throw DspError("graph image connects to a pin which doesn't exist");
+        }
+        graph.Connect(block, pinIdx, graph.blocks[dst], dstPin);
+      }
+    }
+  }
+
+  // Every connection has to have the same spec at both ends, as propagation would have
+  // left it, once the ports and the blocks have had their say
+  inline void CheckImageSignals(ImageGraph& graph) {
+    for (auto block : graph.blocks) {
+      auto& outs = block->getOutputPins();
+      for (uint pinIdx = 0; pinIdx < outs.size(); pinIdx++) {
+        for (auto& sink : outs[pinIdx].sinks) {
+          if (outs[pinIdx].wireSpec.isEmpty() || sink.GetInputPin().wireSpec != outs[pinIdx].wireSpec) {
+            throw DspError("graph image has a connection whose ends don't agree: " + PinName(block, false, pinIdx) +
+                           " to " + PinName(sink.block, true, sink.pinIdx));
+          }
+        }
+      }
+    }
+  }
+
+  // The saved schedule has to hold every block which isn't a port once, in an order
+  // the connections allow
+  inline void ReadImageSchedule(ImageReader& in, ImageGraph& graph) {
+    uint nBlocks = (uint) graph.blocks.size();
+    uint nSteps = in.Read<uint>();
+    auto& t = graph.topology;
+    t.schedulePos.assign(nBlocks, -1);
+    graph.schedule.clear();
+    graph.processing_order.clear();
+    for (uint step = 0; step < nSteps; step++) {
+      uint id = in.Read<uint>();
+      if (id >= nBlocks || graph.blocks[id]->IsPort() || t.schedulePos[id] >= 0) {
+        throw DspError("graph image has a schedule which doesn't match its blocks");
+      }
+      t.schedulePos[id] = (int) step;
+      graph.schedule.push_back(id);
+      graph.processing_order.push_back(graph.blocks[id]);
+    }
+    graph.sources.clear();
+    for (uint id = 0; id < nBlocks; id++) {
+      if (graph.blocks[id]->IsPort()) continue;
+      if (t.schedulePos[id] < 0) {
+        throw DspError("graph image has a schedule which doesn't match its blocks");
+      }
+      if (t.inDegree[id] == 0) { graph.sources.push_back(graph.blocks[id]); }
+      for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+        if (t.schedulePos[t.successors[e]] <= t.schedulePos[id]) {
+          throw DspError("graph image has a schedule which doesn't match its blocks");
+        }
+      }
+    }
+  }
+
+  // The saved buffers have to be a coloring AssignBuffers could have made: each signal's
+  // buffer has its shape, and the signals sharing a buffer are live one after the other.
+  // Intervals come in order of their start, so each only has to be checked against the
+  // one which had its buffer last. That one has to have ended before this one starts,
+  // unless it handed its buffer on to this one, which then has to be written in place
+  // of it.
+  inline void ReadImageBuffers(ImageReader& in, ImageGraph& graph) {
+    auto& pool = *graph.bufferPool;
+    pool.clear();
+    uint nBuffers = in.Read<uint>();
+    for (uint buf = 0; buf < nBuffers; buf++) {
+      pool.push_back(GraphBase::BufferSpec(in.Read<WireSpec>(), nullptr));
+    }
+    if (in.Read<uint>() != graph.liveIntervals.size()) {
+      throw DspError("graph image has buffers which don't match its signals");
+    }
+    vector<GraphBase::LiveInterval*> lastUser(nBuffers, nullptr);
+    for (auto& interval : graph.liveIntervals) {
+      interval.buffer = in.Read<uint>();
+      interval.handedOn = in.ReadBool();
+      if (interval.fused) continue;
+      if (interval.buffer >= nBuffers) {
+        throw DspError("graph image has buffers which don't match its signals");
+      }
+      auto& bufSpec = pool[interval.buffer].wireSpec;
+      auto& ws = interval.pin->wireSpec;
+      if (bufSpec.nChannels != ws.nChannels || bufSpec.bufSize != ws.bufSize) {
+        throw DspError("graph image has a buffer of the wrong shape for its signal");
+      }
+      auto previous = lastUser[interval.buffer];
+      lastUser[interval.buffer] = &interval;
+      if (previous == nullptr) continue;
+      bool overlaps = previous->end >= interval.start;
+      if (previous->handedOn) {
+        overlaps = previous->end != interval.start || interval.start < 0 || graph.chainOf[interval.start] >= 0;
+        if (!overlaps) {
+          auto block = graph.processing_order[interval.start];
+          int inIdx = block->getInPlaceInput((uint) (interval.pin - &block->getOutputPins()[0]));
+          overlaps = inIdx < 0 || &block->getInputPins()[inIdx].source.GetOutputPin() != previous->pin;
+        }
+      }
+      if (overlaps) {
+        throw DspError("graph image has signals sharing a buffer while they are both live");
+      }
+    }
+  }
+
+  // Builds the graph an image in memory describes. Blocks copy their parameters and
+  // tables out of the image, so the memory can go once this returns.
+  inline unique_ptr<ImageGraph> ReadGraphImage(const char* data, size_t size) {
+    ImageReader in(data, size);
+    if (memcmp(in.Take(sizeof(GraphImageMagic)), GraphImageMagic, sizeof(GraphImageMagic)) != 0) {
+      throw DspError("not a graph image");
+    }
+    if (in.Read<uint>() != GraphImageVersion) {
+      throw DspError("graph image is of another version");
+    }
+    if (in.Read<uint32_t>() != GraphImageByteOrder || in.Read<uint>() != sizeof(WireSpec)) {
+      throw DspError("graph image was written on another kind of machine");
+    }
+    WireSpec ws = in.Read<WireSpec>();
+    uint nInputPorts = in.Read<uint>();
+    uint nOutputPorts = in.Read<uint>();
+    if (nInputPorts == 0 || nOutputPorts == 0) {
+      throw DspError("graph image has no ports");
+    }
+    unique_ptr<ImageGraph> graph(new ImageGraph(nInputPorts, nOutputPorts, ws));
+    graph->reuseBuffers = in.ReadBool();
+    graph->fuseElementwise = in.ReadBool();
+
+    uint nBlocks = in.Read<uint>();
+    for (uint id = 0; id < nBlocks; id++) { ReadImageBlock(in, *graph); }
+    if (graph->blocks.size() != nBlocks) {
+      throw DspError("graph image has a block twice");
+    }
+    for (uint id = 0; id < nBlocks; id++) { ReadImagePins(in, *graph, graph->blocks[id]); }
+
+    // As PrepareForOperation, with what the image holds in place of what it works out
+    graph->TopLevelSetup(ws);
+    for (auto block : graph->blocks) {
+      if (!block->IsPort()) { block->updateWireSpecs(); }
+    }
+    CheckImageSignals(*graph);
+    graph->CompileTopology();
+    ReadImageSchedule(in, *graph);
+    graph->FuseChains();
+    graph->ComputeLiveIntervals();
+    ReadImageBuffers(in, *graph);
+    if (!in.AtEnd()) {
+      throw DspError("graph image has data past its end");
+    }
+    graph->AllocateBuffers(*graph->bufferPool);
+    graph->ConnectOutputPorts();
+    graph->RegisterParameters();
+    graph->BuildPlan();
+    graph->ComputeDemand();
+    graph->BuildSilenceTables();
+    graph->prepared = true;
+    graph->compiledBlocks = nBlocks;
+    graph->InitBlocks();
+    return graph;
+  }
+
+  inline unique_ptr<ImageGraph> LoadGraphImage(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw DspError(string("can't open graph image ") + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      throw DspError(string("can't read graph image ") + path);
+    }
+    size_t size = (size_t) info.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      throw DspError(string("can't map graph image ") + path);
+    }
+    try {
+      auto graph = ReadGraphImage(static_cast<const char*>(data), size);
+      munmap(data, size);
+      return graph;
+    } catch (...) {
+      munmap(data, size);
+      throw;
+    }
+  }
+
+}
@@ -0,0 +1,149 @@
+//
+//  InstancePool.hpp
+//
+//  Runs many instances of graphs, and puts the ones with nothing to do to sleep.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "LockFreeQueue.hpp"
+
+#include <atomic>
+#include <memory>
+
+namespace DspBlocks {
+
+  /*
+   With many graph instances hosted at once, most of them are idle at any moment: no
+   input, no parameter changes, and nothing left ringing inside. A graph processed in
+   that state tracks silence and skips all its blocks, but still costs a walk through
+   its plan. The pool stops calling it at all.
+
+   After each cycle, a graph knows whether it was quiet (see GraphBase::quiet): every
+   input silent, no kernel run and no parameter change applied, so nothing in it can
+   have changed, and its outputs have been zeroed. An instance which has been quiet for
+   sleepAfterCycles cycles in a row is put to sleep. A sleeping instance isn't processed
+   at all, and since it was quiet, running it would only have produced the same
+   silence, so when it is woken it simply carries on from where it stopped. Blocks which
+   hold state without tracking silence are run every cycle, which keeps their graph
+   from ever being quiet, so they never lose anything by sleeping.
+
+   An instance is woken when the host says one of its inputs is no longer silent, with
+   SetInputState, or when a control thread changes one of its parameters through the
+   pool's SetParameter. Changes made on the graph itself don't wake it. A control
+   thread's change is pushed to the graph's own ring first, and then the instance is
+   queued for waking, at most once until it has been woken, so the wake queue never
+   fills up. The audio thread wakes queued instances at the start of the next cycle,
+   and the change lands in that cycle as usual.
+
+   The instances which are awake are kept in a dense list, in the order they were
+   woken, and each cycle walks just that list. An instance going to sleep is swapped
+   with the last one in the list.
+
+   The pool doesn't own its graphs, which have to be prepared and initialized before they
+   are added, and all of them have to be added before the audio thread starts. Instances
+   start out awake. SetParameter is for control threads, everything else for the audio
+   thread.
+   */
+
+  struct InstancePool {
+
+    struct Instance {
+      GraphBase* graph;
+      int activePos;          // in active, -1 while asleep
+      uint quietCycles = 0;
+    };
+
+    uint capacity;
+    uint sleepAfterCycles;
+    vector<Instance> instances;
+    vector<uint> active;      // the instances awake, densely
+    MpscQueue<uint> wakeQueue;
+    unique_ptr<atomic<bool>[]> wakeQueued;
+
+    InstancePool(uint capacity, uint sleepAfterCycles = 4) :
+            capacity(capacity), sleepAfterCycles(max(sleepAfterCycles, 1u)) {
+      instances.reserve(capacity);
+      active.reserve(capacity);
+      wakeQueue.Init(capacity);
+      wakeQueued.reset(new atomic<bool>[capacity]);
+      for (uint i = 0; i < capacity; i++) { wakeQueued[i].store(false); }
+    }
+
+    InstancePool(const InstancePool&) = delete;
+
+    uint Add(GraphBase* graph) {
+      if (instances.size() == capacity) {
+        throw DspError("instance pool is full");
+      }
+      if (!graph->prepared) {
+        throw DspError("graph has not been prepared");
+      }
+      uint idx = (uint) instances.size();
+      instances.push_back({ graph, (int) active.size() });
+      active.push_back(idx);
+      return idx;
+    }
+
+    GraphBase& Graph(uint idx) { return *instances[idx].graph; }
+    bool IsAwake(uint idx) { return instances[idx].activePos >= 0; }
+    uint ActiveCount() { return (uint) active.size(); }
+
+    // ------------------ Control Threads --------------------
+
+    bool SetParameter(uint idx, uint id, float value, uint offset = 0) {
+      if (!instances[idx].graph->SetParameter(id, value, offset)) return false;
+      if (!wakeQueued[idx].exchange(true, memory_order_acq_rel)) { wakeQueue.Push(idx); }
+      return true;
+    }
+
+    // ------------------ Audio Thread --------------------
+
+    void Wake(uint idx) {
+      auto& instance = instances[idx];
+      instance.quietCycles = 0;
+      if (instance.activePos >= 0) return;
+      instance.activePos = (int) active.size();
+      active.push_back(idx);
+    }
+
+    void Sleep(uint idx) {
+      auto& instance = instances[idx];
+      uint last = active.back();
+      active[instance.activePos] = last;
+      instances[last].activePos = instance.activePos;
+      active.pop_back();
+      instance.activePos = -1;
+    }
+
+    // Filling an input which was silent wakes the instance. While asleep, its port
+    // buffers are left alone, and its outputs hold the silence of its last cycle.
+    void SetInputState(uint idx, uint portIdx, SignalState state) {
+      instances[idx].graph->SetInputState(portIdx, state);
+      if (state != SignalSilent) { Wake(idx); }
+    }
+
+    // Runs every instance which is awake for nFrames, then puts the ones which have
+    // been quiet long enough to sleep. The list is walked backwards, so an instance
+    // swapped into a sleeper's place has already been seen.
+    void process(uint nFrames) {
+      uint idx;
+      while (wakeQueue.Pop(idx)) {
+        wakeQueued[idx].store(false, memory_order_release);
+        Wake(idx);
+      }
+      for (uint pos = (uint) active.size(); pos-- > 0; ) {
+        auto& instance = instances[active[pos]];
+        instance.graph->process(nFrames);
+        if (!instance.graph->quiet) {
+          instance.quietCycles = 0;
+        } else if (++instance.quietCycles >= sleepAfterCycles) {
+          Sleep(active[pos]);
+        }
+      }
+    }
+
+  };
+
+}
@@ -0,0 +1,120 @@
+//
+//  LockFreeQueue.hpp
+//
+//  Bounded queues for handing items between threads without locks or allocation.
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace DspBlocks {
+
+  // Single producer, single consumer ring. Both ends are wait free: each only ever
+  // writes its own index, and reads the other's to see whether there is room or data.
+  // The storage is allocated up front, so pushing and popping never allocate.
+
+  template <class T>
+  struct SpscQueue {
+    std::vector<T> items;
+    size_t capacity = 0;
+    std::atomic<size_t> head { 0 };   // next item to pop
+    std::atomic<size_t> tail { 0 };   // next slot to push into
+
+    SpscQueue() {}
+    SpscQueue(size_t capacity) { Init(capacity); }
+
+    void Init(size_t capacity) {
+      this->capacity = capacity;
+      items.assign(capacity, T());
+      head.store(0);
+      tail.store(0);
+    }
+
+    bool Push(const T& item) {
+      size_t t = tail.load(std::memory_order_relaxed);
+      if (t - head.load(std::memory_order_acquire) == capacity) return false;
+      items[t % capacity] = item;
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool Pop(T& item) {
+      size_t h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire)) return false;
+      item = items[h % capacity];
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool IsEmpty() {
+      return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+  };
+
+  // Multiple producer, single consumer ring, after Dmitry Vyukov's bounded queue. Each
+  // cell carries a sequence number which says whose turn it is: producers claim a cell by
+  // advancing the tail with a compare-exchange once the cell's sequence shows it free, and
+  // publish it by advancing the sequence again. The consumer owns the head and only has
+  // to check the sequence of the next cell. Producers never wait for each other to finish
+  // writing, and the consumer is wait free. The capacity is rounded up to a power of two.
+
+  template <class T>
+  struct MpscQueue {
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T item;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    std::atomic<size_t> tail { 0 };   // next slot to push into
+    size_t head = 0;                  // next item to pop, consumer only
+
+    MpscQueue() {}
+    MpscQueue(size_t capacity) { Init(capacity); }
+
+    void Init(size_t capacity) {
+      size_t size = 1;
+      while (size < capacity) { size *= 2; }
+      cells.reset(new Cell[size]);
+      for (size_t i = 0; i < size; i++) { cells[i].sequence.store(i, std::memory_order_relaxed); }
+      mask = size - 1;
+      head = 0;
+      tail.store(0);
+    }
+
+    size_t Capacity() { return cells ? mask + 1 : 0; }
+
+    bool Push(const T& item) {
+      size_t pos = tail.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell& cell = cells[pos & mask];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+        if (seq == pos) {
+          if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.item = item;
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (seq < pos) {
+          return false;     // full
+        } else {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool Pop(T& item) {
+      Cell& cell = cells[head & mask];
+      if (cell.sequence.load(std::memory_order_acquire) != head + 1) return false;
+      item = cell.item;
+      cell.sequence.store(head + mask + 1, std::memory_order_release);
+      head++;
+      return true;
+    }
+  };
+
+}
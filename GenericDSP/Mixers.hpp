@@ -12,17 +12,118 @@ namespace DspBlocks {
 
     const char* getClassName() override { return "Two Input Mixer"; }
 
-    void process() override {
-      int nChannels = outputPins[0].wireSpec.nChannels;
-      int bufSize = outputPins[0].wireSpec.bufSize;
-      float** in1Bufs = inputPins[0].buffers;
-      float** in2Bufs = inputPins[1].buffers;
-      float** outBufs = outputPins[0].buffers;
-      for (int ch = 0; ch < nChannels; ch++) {
-        vDSP_vadd(in1Bufs[ch], 1, in2Bufs[ch], 1, outBufs[ch], 1, bufSize);
+    void run(const KernelArgs& args) {
+      uint endChannel = args.firstChannel + args.nChannels;
+      float** in1Bufs = args.inputs[0];
+      float** in2Bufs = args.inputs[1];
+      float** outBufs = args.outputs[0];
+      for (uint ch = args.firstChannel; ch < endChannel; ch++) {
+        uint f = args.firstFrame;
+        vDSP_vadd(in1Bufs[ch] + f, 1, in2Bufs[ch] + f, 1, outBufs[ch] + f, 1, args.nFrames);
       }
     }
 
+    Kernel getKernel() override { return { &RunKernel<TwoInputMixer>, this }; }
+    void process() override { run(PinArgs()); }
+    int getInPlaceInput(uint outputPinIdx) override { return 0; }
+    bool IsChannelIndependent() override { return true; }
+    bool TracksSilence() override { return true; }
+    SignalState getOutputState(SignalState inputs, uint nFrames) override { return inputs; }
+
+    bool getElementOp(ElementOp& op) override {
+      op.kind = ElementOp::OpAdd;
+      return true;
+    }
+
+  };
+
+  struct Gain : DspBlockSingleWireSpec {
+    float gain = 1.0;
+
+    Gain() : DspBlockSingleWireSpec(1,1) { }
+
+    Gain(float gain) : Gain() {
+      this->gain = gain;
+    }
+
+    const char* getClassName() override { return "Gain"; }
+
+    void run(const KernelArgs& args) {
+      uint endChannel = args.firstChannel + args.nChannels;
+      float** inBufs = args.inputs[0];
+      float** outBufs = args.outputs[0];
+      for (uint ch = args.firstChannel; ch < endChannel; ch++) {
+        uint f = args.firstFrame;
+        vDSP_vsmul(inBufs[ch] + f, 1, &gain, outBufs[ch] + f, 1, args.nFrames);
+      }
+    }
+
+    Kernel getKernel() override { return { &RunKernel<Gain>, this }; }
+    void process() override { run(PinArgs()); }
+    int getInPlaceInput(uint outputPinIdx) override { return 0; }
+    bool IsChannelIndependent() override { return true; }
+    bool TracksSilence() override { return true; }
+    SignalState getOutputState(SignalState inputs, uint nFrames) override { return inputs; }
+
+    bool getElementOp(ElementOp& op) override {
+      op.kind = ElementOp::OpScale;
+      op.param1 = &gain;
+      return true;
+    }
+
+    void getParameters(vector<ParameterSpec>& params) override {
+      params.push_back({ "gain", &gain });
+    }
+
+  };
+
+  struct Clip : DspBlockSingleWireSpec {
+    float low = -1.0;
+    float high = 1.0;
+
+    Clip() : DspBlockSingleWireSpec(1,1) { }
+
+    Clip(float low, float high) : Clip() {
+      this->low = low;
+      this->high = high;
+    }
+
+    const char* getClassName() override { return "Clip"; }
+
+    void run(const KernelArgs& args) {
+      uint endChannel = args.firstChannel + args.nChannels;
+      float** inBufs = args.inputs[0];
+      float** outBufs = args.outputs[0];
+      for (uint ch = args.firstChannel; ch < endChannel; ch++) {
+        uint f = args.firstFrame;
+        vDSP_vclip(inBufs[ch] + f, 1, &low, &high, outBufs[ch] + f, 1, args.nFrames);
+      }
+    }
+
+    Kernel getKernel() override { return { &RunKernel<Clip>, this }; }
+    void process() override { run(PinArgs()); }
+    int getInPlaceInput(uint outputPinIdx) override { return 0; }
+    bool IsChannelIndependent() override { return true; }
+
+    // Silence only stays silent if zero is inside the limits
+    bool TracksSilence() override { return true; }
+    SignalState getOutputState(SignalState inputs, uint nFrames) override {
+      if (inputs == SignalSilent && (low > 0 || high < 0)) return SignalConstant;
+      return inputs;
+    }
+
+    bool getElementOp(ElementOp& op) override {
+      op.kind = ElementOp::OpClip;
+      op.param1 = &low;
+      op.param2 = &high;
+      return true;
+    }
+
+    void getParameters(vector<ParameterSpec>& params) override {
+      params.push_back({ "low", &low });
+      params.push_back({ "high", &high });
+    }
+
   };
 
 }
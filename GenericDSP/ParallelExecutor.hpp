@@ -0,0 +1,230 @@
+//
+//  ParallelExecutor.hpp
+//
+//  Runs the plan of a prepared GraphBase on several threads.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "Parking.hpp"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace DspBlocks {
+
+  // Runs one buffer cycle of a graph on a pool of persistent worker threads plus the
+  // calling thread. Each step of the graph's plan has an atomic count of predecessors
+  // which haven't run yet in the current cycle. A thread which finishes a step counts
+  // down its successors and queues those which reach zero, so independent branches run
+  // on different cores while every block still sees its inputs complete.
+  //
+  // A wide block which is channel independent can be split into several tasks, each
+  // running the block's kernel on part of its channels. The split is worked out once, at
+  // construction: a step is only split if each task still gets at least minWorkPerTask
+  // samples (channels times frames), and never into more tasks than there are threads.
+  // Each step then counts its unfinished tasks, and whichever task finishes last counts
+  // down the step's successors.
+  //
+  // Steps the graph has no demand for still count down their successors, they just
+  // don't run their kernel.
+  //
+  // The graph has to be prepared with reuseBuffers turned off, since buffer reuse
+  // assumes the blocks run one at a time. Between cycles, workers wait in a Parking.
+
+  struct ParallelExecutor {
+
+    // Each task is queued exactly once per cycle, so a queue with room for all the tasks
+    // never fills up and needs no wrap around. Pushing claims a slot with one fetch_add
+    // and then publishes the task in it. Popping claims the next slot with a
+    // compare-exchange and waits for the task to be published, which the pushing thread
+    // does right after claiming.
+
+    struct ReadyQueue {
+      unique_ptr<atomic<int>[]> slots;
+      uint capacity = 0;
+      atomic<uint> head { 0 };
+      atomic<uint> tail { 0 };
+
+      void Init(uint capacity) {
+        this->capacity = capacity;
+        slots.reset(new atomic<int>[capacity]);
+        Reset();
+      }
+
+      // only while no other thread is using the queue
+      void Reset() {
+        for (uint i = 0; i < capacity; i++) { slots[i].store(-1, memory_order_relaxed); }
+        head.store(0, memory_order_relaxed);
+        tail.store(0, memory_order_release);
+      }
+
+      void Push(uint task) {
+        uint slot = tail.fetch_add(1, memory_order_acq_rel);
+        slots[slot].store((int) task, memory_order_release);
+      }
+
+      bool Pop(uint& task) {
+        uint slot = head.load(memory_order_acquire);
+        while (slot < tail.load(memory_order_acquire)) {
+          if (head.compare_exchange_weak(slot, slot + 1, memory_order_acq_rel)) {
+            int t;
+            while ((t = slots[slot].load(memory_order_acquire)) < 0) { }
+            task = (uint) t;
+            return true;
+          }
+        }
+        return false;
+      }
+    };
+
+    // One call of a step's kernel, on all of the step's channels or just some of them
+    struct Task {
+      uint step;
+      KernelArgs args;
+    };
+
+    GraphBase& graph;
+    uint nThreads;
+    uint minWorkPerTask;
+    uint nSteps = 0;
+    // successors of each step, CSR style, indexed by position in the plan
+    vector<uint> successorStart;
+    vector<uint> successors;
+    vector<uint> nPredecessors;
+    vector<uint> initialSteps;
+    // the tasks of each step, CSR style as well
+    vector<uint> taskStart;
+    vector<Task> tasks;
+    unique_ptr<atomic<uint>[]> pending;
+    unique_ptr<atomic<uint>[]> unfinishedTasks;
+    ReadyQueue ready;
+    atomic<uint> remaining { 0 };
+    atomic<uint> generation { 0 };
+    atomic<bool> stopping { false };
+    Parking parking;
+    vector<thread> workers;
+
+    // nThreads counts the calling thread, so nThreads - 1 workers are started
+    ParallelExecutor(GraphBase& graph, uint nThreads, uint minWorkPerTask = 4096) :
+            graph(graph), nThreads(max(nThreads, 1u)), minWorkPerTask(max(minWorkPerTask, 1u)) {
+      if (graph.reuseBuffers) {
+        throw DspError("graph must be prepared without buffer reuse to run in parallel");
+      }
+      BuildDependencies();
+      BuildTasks();
+      for (uint i = 1; i < nThreads; i++) {
+        workers.emplace_back([this] { WorkerLoop(); });
+      }
+      graph.attachedExecutors++;
+    }
+
+    ParallelExecutor(const ParallelExecutor&) = delete;
+
+    ~ParallelExecutor() {
+      graph.attachedExecutors--;
+      stopping.store(true, memory_order_release);
+      parking.Wake();
+      for (auto& worker : workers) { worker.join(); }
+    }
+
+    // The graph's topology is in block ids, the plan in schedule positions
+    void BuildDependencies() {
+      auto& t = graph.topology;
+      nSteps = (uint) graph.plan.size();
+      successorStart.assign(nSteps + 1, 0);
+      successors.clear();
+      nPredecessors.assign(nSteps, 0);
+      initialSteps.clear();
+      for (uint step = 0; step < nSteps; step++) {
+        uint id = graph.schedule[step];
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          successors.push_back((uint) t.schedulePos[t.successors[e]]);
+        }
+        successorStart[step + 1] = (uint) successors.size();
+        nPredecessors[step] = t.inDegree[id];
+        if (nPredecessors[step] == 0) { initialSteps.push_back(step); }
+      }
+      pending.reset(new atomic<uint>[nSteps]);
+    }
+
+    void BuildTasks() {
+      taskStart.assign(nSteps + 1, 0);
+      tasks.clear();
+      for (uint step = 0; step < nSteps; step++) {
+        auto& args = graph.plan[step].args;
+        uint nTasks = 1;
+        if (graph.plan[step].kernel.func != nullptr && graph.processing_order[step]->IsChannelIndependent()) {
+          uint work = args.nChannels * args.nFrames;
+          nTasks = max(1u, min({ args.nChannels, nThreads, work / minWorkPerTask }));
+        }
+        // spread the channels as evenly as possible
+        for (uint i = 0; i < nTasks; i++) {
+          Task task { step, args };
+          task.args.firstChannel = args.firstChannel + args.nChannels * i / nTasks;
+          task.args.nChannels = args.firstChannel + args.nChannels * (i + 1) / nTasks - task.args.firstChannel;
+          tasks.push_back(task);
+        }
+        taskStart[step + 1] = (uint) tasks.size();
+      }
+      unfinishedTasks.reset(new atomic<uint>[nSteps]);
+      ready.Init((uint) tasks.size());
+    }
+
+    void PushStep(uint step) {
+      for (uint task = taskStart[step]; task < taskStart[step + 1]; task++) { ready.Push(task); }
+    }
+
+    // Runs one cycle, and returns when every block has been processed
+    void process() {
+      graph.ApplyParameterChanges();
+      if (nSteps == 0) return;
+      ready.Reset();
+      for (uint step = 0; step < nSteps; step++) {
+        pending[step].store(nPredecessors[step], memory_order_relaxed);
+        unfinishedTasks[step].store(taskStart[step + 1] - taskStart[step], memory_order_relaxed);
+      }
+      remaining.store(nSteps, memory_order_relaxed);
+      for (auto step : initialSteps) { PushStep(step); }
+      generation.fetch_add(1, memory_order_release);
+      parking.Wake();
+      while (remaining.load(memory_order_acquire) > 0) {
+        if (!RunReadyTask()) { this_thread::yield(); }
+      }
+    }
+
+    bool RunReadyTask() {
+      uint t;
+      if (!ready.Pop(t)) return false;
+      auto& task = tasks[t];
+      auto& kernel = graph.plan[task.step].kernel;
+      if (kernel.func != nullptr && graph.IsDemanded(task.step)) { kernel.func(kernel.state, task.args); }
+      if (unfinishedTasks[task.step].fetch_sub(1, memory_order_acq_rel) > 1) return true;
+      for (uint e = successorStart[task.step]; e < successorStart[task.step + 1]; e++) {
+        uint next = successors[e];
+        if (pending[next].fetch_sub(1, memory_order_acq_rel) == 1) { PushStep(next); }
+      }
+      remaining.fetch_sub(1, memory_order_acq_rel);
+      return true;
+    }
+
+    void WorkerLoop() {
+      uint seen = generation.load(memory_order_acquire);
+      for (;;) {
+        parking.Wait([&] {
+          return stopping.load(memory_order_acquire) || generation.load(memory_order_acquire) != seen;
+        });
+        if (stopping.load(memory_order_acquire)) return;
+        uint current = generation.load(memory_order_acquire);
+        while (remaining.load(memory_order_acquire) > 0) {
+          if (!RunReadyTask()) { this_thread::yield(); }
+        }
+        seen = current;
+      }
+    }
+
+  };
+
+}
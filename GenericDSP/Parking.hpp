@@ -0,0 +1,65 @@
+//
+//  Parking.hpp
+//
+//  Where executor threads wait for work between cycles.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace DspBlocks {
+
+  // The next cycle usually comes within a buffer's time, and a thread which is asleep
+  // when it does costs the cycle a wake up from the OS. So a thread waiting for work
+  // spins for spinMicros first, giving up the core now and then, and only then goes to
+  // sleep on a condition variable. A host which stops calling the executor, or pauses
+  // between offline renders, leaves its threads asleep rather than holding their cores.
+  //
+  // Whoever makes the condition true calls Wake afterwards. That is one atomic load
+  // when nobody is asleep, so it can be done from the audio thread every cycle; it only
+  // locks while a thread has actually gone to sleep, after the host has been away for
+  // longer than the spin. The fences make sure that either the waker sees the sleeper,
+  // or the sleeper sees the condition before it goes to sleep.
+
+  struct Parking {
+    std::mutex mutex;
+    std::condition_variable wakeUp;
+    std::atomic<uint> sleepers { 0 };
+    uint spinMicros;
+
+    Parking(uint spinMicros = 2000) : spinMicros(spinMicros) {}
+
+    template <class Condition>
+    void Wait(Condition ready) {
+      auto start = std::chrono::steady_clock::now();
+      for (uint spins = 0; !ready(); spins++) {
+        if (spins < 64) continue;
+        if (std::chrono::steady_clock::now() - start < std::chrono::microseconds(spinMicros)) {
+          std::this_thread::yield();
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeUp.wait(lock, ready);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    void Wake() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleepers.load(std::memory_order_relaxed) == 0) return;
+      std::lock_guard<std::mutex> lock(mutex);
+      wakeUp.notify_all();
+    }
+  };
+
+}
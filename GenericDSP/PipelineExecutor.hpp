@@ -0,0 +1,280 @@
+//
+//  PipelineExecutor.hpp
+//
+//  Runs a prepared GraphBase as a pipeline of stages on separate threads, trading a
+//  fixed latency for throughput.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "LockFreeQueue.hpp"
+#include "Parking.hpp"
+
+#include <atomic>
+#include <thread>
+
+namespace DspBlocks {
+
+  // A long serial chain has no branches to run in parallel, but it can still be spread
+  // over several cores by cutting the processing order into stages and letting each
+  // stage work on a different buffer cycle: while the last stage finishes cycle n-K+1,
+  // the first is already on cycle n. Stages hand cycles on through SPSC queues. The
+  // price is K-1 buffers of extra latency, which LatencyFrames reports.
+  //
+  // Stages are contiguous ranges of the plan, balanced by measured block costs, so
+  // signals only ever flow to the same or a later stage. Up to K cycles are in flight,
+  // so every signal which crosses from one stage to another (including the graph's
+  // input and output) gets K copies, one per slot, with cycle n using slot n % K. A
+  // signal which stays inside a stage only ever has one cycle in use at a time and keeps
+  // its single buffer. Like the other parallel executors, the graph has to be prepared
+  // with reuseBuffers turned off. Each stage waits for its next cycle in a Parking of its
+  // own, which is woken by whoever pushes into the stage's queue.
+  //
+  // Stages are always busy with some cycle, so there is no one point at which the graph's
+  // queued parameter changes could be applied to every block. Instead process() drains
+  // the graph's ring before it hands in each cycle, and passes each change on to the
+  // stage which runs the parameter's block, tagged with the cycle. Every stage applies
+  // its own changes when it starts that cycle, so a change lands in the same cycle all
+  // through the pipeline, and is only ever written by the thread which reads it. As with
+  // the other executors, offsets are ignored.
+  //
+  // Demand is handed on the same way. The host may switch sinks between calls to
+  // process() while the stages are still busy with earlier cycles, so process() copies
+  // which steps are demanded into the cycle's slot, and the stages only read that copy.
+
+  struct PipelineExecutor {
+
+    struct Stage {
+      uint firstStep;
+      uint endStep;
+    };
+
+    struct StageChange {
+      uint cycle;
+      uint id;
+      float value;
+    };
+
+    GraphBase& graph;
+    uint nStages;
+    uint nSlots;
+    vector<Stage> stages;
+    BufferArena arena;                      // the extra slot copies of crossing signals
+    vector<vector<float**>> slotBuffers;    // [pool buffer][slot]
+    vector<vector<float**>> slotPlanBuffers;
+    vector<vector<KernelArgs>> slotArgs;    // [slot][step]
+    vector<vector<uint8_t>> slotDemand;     // [slot][step]
+    vector<float**> inputBuffers;           // per slot
+    vector<float**> outputBuffers;
+    WireSpec inputSpec;
+    WireSpec outputSpec;
+
+    // queues[k] carries cycle numbers into stage k, the last one back to the host
+    unique_ptr<SpscQueue<uint>[]> queues;
+    unique_ptr<Parking[]> parking;                      // per stage
+    vector<uint> parameterStage;                        // by parameter id
+    unique_ptr<SpscQueue<StageChange>[]> stageChanges;  // per stage
+    atomic<bool> stopping { false };
+    vector<thread> threads;
+    uint submitted = 0;
+
+    PipelineExecutor(GraphBase& graph, uint nStages, uint nCostRuns = 8) : graph(graph) {
+      if (graph.reuseBuffers) {
+        throw DspError("graph must be prepared without buffer reuse to run in parallel");
+      }
+      uint nSteps = (uint) graph.plan.size();
+      this->nStages = max(1u, min(nStages, nSteps));
+      nSlots = this->nStages;
+      DivideIntoStages(graph.MeasureStepCosts(nCostRuns));
+      CreateSlots();
+      RouteParameters();
+      slotDemand.assign(nSlots, vector<uint8_t>(nSteps, 1));
+      queues.reset(new SpscQueue<uint>[this->nStages + 1]);
+      for (uint k = 0; k <= this->nStages; k++) { queues[k].Init(nSlots); }
+      parking.reset(new Parking[this->nStages]);
+      for (uint k = 0; k < this->nStages; k++) {
+        threads.emplace_back([this, k] { StageLoop(k); });
+      }
+      graph.attachedExecutors++;
+    }
+
+    PipelineExecutor(const PipelineExecutor&) = delete;
+
+    ~PipelineExecutor() {
+      graph.attachedExecutors--;
+      stopping.store(true, memory_order_release);
+      for (uint k = 0; k < nStages; k++) { parking[k].Wake(); }
+      for (auto& th : threads) { th.join(); }
+    }
+
+    // The extra latency, which the host has to compensate for
+    uint LatencyFrames() { return (nStages - 1) * outputSpec.bufSize; }
+
+    // ------------------ Construction --------------------
+
+    // Cut the plan where the running cost passes each multiple of total / K, making sure
+    // every stage gets at least one step
+    void DivideIntoStages(const vector<double>& cost) {
+      uint nSteps = (uint) cost.size();
+      double total = 0;
+      for (auto c : cost) { total += c; }
+      stages.clear();
+      double sum = 0;
+      uint first = 0;
+      for (uint step = 0; step < nSteps && stages.size() + 1 < nStages; step++) {
+        sum += cost[step];
+        uint stepsLeft = nSteps - step - 1;
+        uint stagesLeft = nStages - (uint) stages.size() - 1;
+        if (sum >= total * (stages.size() + 1) / nStages || stepsLeft == stagesLeft) {
+          stages.push_back({ first, step + 1 });
+          first = step + 1;
+        }
+      }
+      stages.push_back({ first, nSteps });
+    }
+
+    int StageOf(int pos) {
+      if (pos < 0) return -1;
+      for (uint k = 0; k < stages.size(); k++) {
+        if ((uint) pos < stages[k].endStep) return (int) k;
+      }
+      return (int) stages.size();   // read by the host after the cycle
+    }
+
+    // Every pool buffer of the graph holds exactly one signal, so the signal's live
+    // interval tells which stages write and read the buffer
+    void CreateSlots() {
+      auto& pool = *graph.bufferPool;
+      slotBuffers.assign(pool.size(), vector<float**>(nSlots, nullptr));
+      unordered_map<float**, uint> poolIndex;
+      arena.Reset();
+      for (auto& interval : graph.liveIntervals) {
+        if (interval.fused) continue;
+        auto& copies = slotBuffers[interval.buffer];
+        copies[0] = pool[interval.buffer].buffers;
+        poolIndex[copies[0]] = interval.buffer;
+        bool crossing = StageOf(interval.start) != StageOf(interval.end);
+        for (uint slot = 1; slot < nSlots; slot++) {
+          if (crossing) {
+            arena.Reserve(pool[interval.buffer].wireSpec, &copies[slot]);
+          } else {
+            copies[slot] = copies[0];
+          }
+        }
+      }
+      arena.Commit();
+
+      auto& base = graph.planBuffers;
+      slotPlanBuffers.assign(nSlots, vector<float**>(base.size()));
+      slotArgs.assign(nSlots, vector<KernelArgs>(graph.plan.size()));
+      for (uint slot = 0; slot < nSlots; slot++) {
+        auto& buffers = slotPlanBuffers[slot];
+        for (size_t i = 0; i < base.size(); i++) {
+          auto it = poolIndex.find(base[i]);
+          buffers[i] = (it == poolIndex.end()) ? base[i] : slotBuffers[it->second][slot];
+        }
+        for (size_t step = 0; step < graph.plan.size(); step++) {
+          auto args = graph.plan[step].args;
+          args.inputs = buffers.data() + (args.inputs - base.data());
+          args.outputs = buffers.data() + (args.outputs - base.data());
+          slotArgs[slot][step] = args;
+        }
+      }
+
+      auto& inPin = graph.inputPorts[0].getOutputPins()[0];
+      auto& outPin = graph.outputPorts[0].getInputPins()[0].source.GetOutputPin();
+      inputSpec = inPin.wireSpec;
+      outputSpec = outPin.wireSpec;
+      auto& inCopies = slotBuffers[graph.liveIntervals[graph.pinIntervals[&inPin]].buffer];
+      auto& outCopies = slotBuffers[graph.liveIntervals[graph.pinIntervals[&outPin]].buffer];
+      inputBuffers = inCopies;
+      outputBuffers = outCopies;
+    }
+
+    // A stage starts a cycle at most nSlots cycles after it has been handed in, so its
+    // queue never holds more than that many cycles' changes
+    void RouteParameters() {
+      parameterStage.resize(graph.parameters.size());
+      for (uint id = 0; id < graph.parameters.size(); id++) {
+        parameterStage[id] = (uint) StageOf(graph.parameterSteps[id]);
+      }
+      stageChanges.reset(new SpscQueue<StageChange>[nStages]);
+      for (uint k = 0; k < nStages; k++) {
+        stageChanges[k].Init(GraphBase::ParameterQueueSize * (nSlots + 1));
+      }
+    }
+
+    // ------------------ Execution --------------------
+
+    // No more than ParameterQueueSize changes are taken per cycle, as in GraphBase::process
+    void RouteParameterChanges(uint cycle) {
+      GraphBase::ParameterChange change;
+      for (uint n = 0; n < GraphBase::ParameterQueueSize && graph.parameterChanges.Pop(change); n++) {
+        stageChanges[parameterStage[change.id]].Push({ cycle, change.id, change.value });
+      }
+    }
+
+    template <class Condition>
+    bool SpinUntil(Condition done) {
+      for (uint spins = 0; !done(); spins++) {
+        if (stopping.load(memory_order_acquire)) return false;
+        if (spins >= 64) { this_thread::yield(); }
+      }
+      return true;
+    }
+
+    void StageLoop(uint k) {
+      auto& stage = stages[k];
+      uint cycle = 0;
+      StageChange change;
+      bool holding = false;     // a change popped ahead of its cycle
+      for (;;) {
+        parking[k].Wait([&] { return stopping.load(memory_order_acquire) || queues[k].Pop(cycle); });
+        if (stopping.load(memory_order_acquire)) return;
+        while (holding || stageChanges[k].Pop(change)) {
+          holding = (int) (change.cycle - cycle) > 0;
+          if (holding) break;
+          *graph.parameters[change.id].value = change.value;
+        }
+        auto& args = slotArgs[cycle % nSlots];
+        auto& demanded = slotDemand[cycle % nSlots];
+        for (uint step = stage.firstStep; step < stage.endStep; step++) {
+          auto& kernel = graph.plan[step].kernel;
+          if (kernel.func == nullptr || !demanded[step]) continue;
+          kernel.func(kernel.state, args[step]);
+        }
+        queues[k + 1].Push(cycle);
+        if (k + 1 < nStages) { parking[k + 1].Wake(); }
+      }
+    }
+
+    // Hands in one buffer of input, and returns the output of the cycle submitted K-1
+    // calls ago. Until the pipeline has filled, the output is silence.
+    void process(float** in, float** out) {
+      uint slot = submitted % nSlots;
+      for (uint ch = 0; ch < inputSpec.nChannels; ch++) {
+        copy(in[ch], in[ch] + inputSpec.bufSize, inputBuffers[slot][ch]);
+      }
+      auto& demanded = slotDemand[slot];
+      for (uint step = 0; step < demanded.size(); step++) { demanded[step] = graph.IsDemanded(step); }
+      RouteParameterChanges(submitted);
+      queues[0].Push(submitted++);
+      parking[0].Wake();
+      if (submitted < nStages) {
+        for (uint ch = 0; ch < outputSpec.nChannels; ch++) {
+          fill(out[ch], out[ch] + outputSpec.bufSize, 0.0f);
+        }
+        return;
+      }
+      uint done = 0;
+      SpinUntil([&] { return queues[nStages].Pop(done); });
+      float** result = outputBuffers[done % nSlots];
+      for (uint ch = 0; ch < outputSpec.nChannels; ch++) {
+        copy(result[ch], result[ch] + outputSpec.bufSize, out[ch]);
+      }
+    }
+
+  };
+
+}
@@ -0,0 +1,223 @@
+//
+//  Resamplers.hpp
+//
+//  Integer ratio sample rate converters, which GraphBase puts between parts of a graph
+//  that run at different rates.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "GraphImage.hpp"
+#include <Accelerate/Accelerate.h>
+#include <math.h>
+
+namespace DspBlocks {
+
+  // Both converters filter with the same kind of windowed sinc lowpass, cut off just
+  // below the Nyquist frequency of the lower rate, with TapsPerPhase taps for every
+  // sample at the lower rate. They are polyphase: the decimator only computes the
+  // outputs it keeps, and the interpolator never multiplies the zeros it stuffs in. Each
+  // keeps the last few input samples of every channel in front of the new ones, in a
+  // buffer from the graph's arena, so a filter window never has to wrap. The filters are
+  // designed in init(), unless they were loaded from a graph image.
+
+  struct Resampler : DspBase {
+    static const uint TapsPerPhase = 16;
+
+    uint decimation;
+    uint interpolation;
+    uint nTaps;
+    uint historyFrames;
+    vector<float> taps;
+    float** history = nullptr;
+
+    Resampler(uint decimation, uint interpolation) :
+            DspBase(1, 1), decimation(decimation), interpolation(interpolation) {
+      nTaps = TapsPerPhase * max(decimation, interpolation);
+    }
+
+    void DesignFilter() {
+      uint ratio = max(decimation, interpolation);
+      taps.resize(nTaps);
+      double cutoff = 0.45 / ratio;   // cycles per sample, at the higher rate
+      double center = (nTaps - 1) / 2.0;
+      double sum = 0;
+      for (uint i = 0; i < nTaps; i++) {
+        double x = i - center;
+        double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * cos(2 * M_PI * i / (nTaps - 1)) + 0.08 * cos(4 * M_PI * i / (nTaps - 1));
+        taps[i] = (float) (sinc * window);
+        sum += taps[i];
+      }
+      for (auto& tap : taps) { tap = (float) (tap / sum); }
+    }
+
+    WireSpec OutputSpec(WireSpec in) {
+      if (in.bufSize % decimation != 0) {
+        throw DspError("buffer size isn't a multiple of the decimation factor");
+      }
+      return WireSpec(in.nChannels, in.sampleRate * interpolation / decimation,
+                      in.bufSize * interpolation / decimation);
+    }
+
+    WireSpec InputSpec(WireSpec out) {
+      if (out.bufSize % interpolation != 0) {
+        throw DspError("buffer size isn't a multiple of the interpolation factor");
+      }
+      return WireSpec(out.nChannels, out.sampleRate * decimation / interpolation,
+                      out.bufSize * decimation / interpolation);
+    }
+
+    bool updateWireSpecs() override {
+      Pin& in = inputPins[0];
+      Pin& out = outputPins[0];
+      if (in.wireSpec.isEmpty() == out.wireSpec.isEmpty()) {
+        if (!in.wireSpec.isEmpty() && OutputSpec(in.wireSpec) != out.wireSpec) {
+          throw DspError("conflicting wire specs across a resampler: " + PinName(this, true, 0) + " has " +
+                         in.wireSpec.Description() + ", " + PinName(this, false, 0) + " has " + out.wireSpec.Description());
+        }
+        return false;
+      }
+      if (out.wireSpec.isEmpty()) {
+        out.wireSpec = OutputSpec(in.wireSpec);
+        out.PropagateWireSpecs();
+      } else {
+        in.wireSpec = InputSpec(out.wireSpec);
+        in.PropagateWireSpecs();
+      }
+      return true;
+    }
+
+    WireSpec getInputWireSpec(uint pinIdx) override { return inputPins[0].wireSpec; }
+    WireSpec getOutputWireSpec(uint pinIdx) override { return outputPins[0].wireSpec; }
+
+    void ReserveBuffers(BufferArena& arena) override {
+      WireSpec in = inputPins[0].wireSpec;
+      in.bufSize += historyFrames;
+      arena.Reserve(in, &history);
+    }
+
+    void init() override {
+      for (uint ch = 0; ch < inputPins[0].wireSpec.nChannels; ch++) {
+        fill(history[ch], history[ch] + historyFrames, 0.0f);
+      }
+    }
+
+    // Appends nFrames of input after a channel's history, and returns where the history
+    // starts. KeepHistory then moves the last historyFrames samples to the front again.
+    float* AppendInput(uint ch, const float* in, uint nFrames) {
+      copy(in, in + nFrames, history[ch] + historyFrames);
+      return history[ch];
+    }
+
+    void KeepHistory(uint ch, uint nFrames) {
+      float* h = history[ch];
+      move(h + nFrames, h + nFrames + historyFrames, h);
+    }
+
+    void SaveState(vector<float>& state) override {
+      for (uint ch = 0; ch < inputPins[0].wireSpec.nChannels; ch++) {
+        state.insert(state.end(), history[ch], history[ch] + historyFrames);
+      }
+    }
+
+    void RestoreState(const float*& state) override {
+      for (uint ch = 0; ch < inputPins[0].wireSpec.nChannels; ch++) {
+        copy(state, state + historyFrames, history[ch]);
+        state += historyFrames;
+      }
+    }
+
+    bool IsResampler() override { return true; }
+    bool IsChannelIndependent() override { return true; }
+
+    // Silent once the history holds nothing but the zeros of silent inputs
+    bool TracksSilence() override { return true; }
+
+    SignalState getOutputState(SignalState inputs, uint nFrames) override {
+      return SilentAfterTail(inputs, nFrames, nTaps);
+    }
+  };
+
+  // Keeps every decimation'th sample of the filtered input. vDSP_desamp does exactly
+  // that, given the history in front of the input.
+
+  struct Decimator : Resampler {
+
+    Decimator(uint factor) : Resampler(factor, 1) { historyFrames = nTaps - 1; }
+
+    const char* getClassName() override { return "Decimator"; }
+    void SaveConfig(ImageWriter& config) override { config.Write(decimation); }
+    void getTables(vector<TableSpec>& tables) override { tables.push_back({ "taps", &taps, nTaps }); }
+
+    void init() override {
+      if (taps.empty()) { DesignFilter(); }
+      Resampler::init();
+    }
+
+    void run(const KernelArgs& args) {
+      uint inFrames = args.nFrames * decimation;
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        const float* in = args.inputs[0][ch] + args.firstFrame * decimation;
+        float* window = AppendInput(ch, in, inFrames);
+        vDSP_desamp(window, decimation, taps.data(), args.outputs[0][ch] + args.firstFrame,
+                    args.nFrames, nTaps);
+        KeepHistory(ch, inFrames);
+      }
+    }
+
+    Kernel getKernel() override { return { &RunKernel<Decimator>, this }; }
+    void process() override { run(PinArgs()); }
+  };
+
+  // Output sample n * interpolation + p is input samples n, n - 1, ... weighted by taps
+  // p, p + interpolation, ..., which phases holds reversed and scaled by the factor, one
+  // phase after the other, so each output is one short dot product.
+
+  struct Interpolator : Resampler {
+    vector<float> phases;
+
+    Interpolator(uint factor) : Resampler(1, factor) { historyFrames = TapsPerPhase - 1; }
+
+    const char* getClassName() override { return "Interpolator"; }
+    void SaveConfig(ImageWriter& config) override { config.Write(interpolation); }
+    void getTables(vector<TableSpec>& tables) override { tables.push_back({ "phases", &phases, nTaps }); }
+
+    void init() override {
+      if (phases.empty()) {
+        DesignFilter();
+        phases.resize(nTaps);
+        for (uint p = 0; p < interpolation; p++) {
+          for (uint q = 0; q < TapsPerPhase; q++) {
+            phases[p * TapsPerPhase + q] = interpolation * taps[p + (TapsPerPhase - 1 - q) * interpolation];
+          }
+        }
+      }
+      Resampler::init();
+    }
+
+    void run(const KernelArgs& args) {
+      uint inFrames = args.nFrames / interpolation;
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        const float* in = args.inputs[0][ch] + args.firstFrame / interpolation;
+        float* out = args.outputs[0][ch] + args.firstFrame;
+        float* window = AppendInput(ch, in, inFrames);
+        for (uint n = 0; n < inFrames; n++) {
+          const float* x = window + n;
+          for (uint p = 0; p < interpolation; p++) {
+            const float* h = &phases[p * TapsPerPhase];
+            float acc = 0;
+            for (uint q = 0; q < TapsPerPhase; q++) { acc += h[q] * x[q]; }
+            *out++ = acc;
+          }
+        }
+        KeepHistory(ch, inFrames);
+      }
+    }
+
+    Kernel getKernel() override { return { &RunKernel<Interpolator>, this }; }
+    void process() override { run(PinArgs()); }
+  };
+
+}
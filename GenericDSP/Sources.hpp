@@ -24,14 +24,35 @@ namespace DspBlocks {
 
     void init() override { phase = 0; }
     
-    void process() override {
-      auto pin = outputPins[0];
-      WireSpec& ws = pin.wireSpec;
-      for (int samp=0; samp < ws.bufSize; samp++) {
-        pin.buffers[0][samp] = sin(phase * 2 * M_PI) * amplitude;
-        phase += frequency / ws.sampleRate;
+    void run(const KernelArgs& args) {
+      float* out = args.outputs[0][0] + args.firstFrame;
+      float increment = frequency / sharedWireSpec.sampleRate;
+      for (int samp=0; samp < args.nFrames; samp++) {
+        out[samp] = sin(phase * 2 * M_PI) * amplitude;
+        phase += increment;
       }
     }
+
+    Kernel getKernel() override { return { &RunKernel<SineGen>, this }; }
+    void process() override { run(PinArgs()); }
+
+    void CopyStateFrom(DspInterface& other) override {
+      phase = static_cast<SineGen&>(other).phase;
+    }
+
+    void SaveState(vector<float>& state) override { state.push_back(phase); }
+    void RestoreState(const float*& state) override { phase = *state++; }
+
+    void getParameters(vector<ParameterSpec>& params) override {
+      params.push_back({ "frequency", &frequency });
+      params.push_back({ "amplitude", &amplitude });
+    }
+
+    // Silent at zero amplitude. The phase doesn't advance meanwhile.
+    bool TracksSilence() override { return true; }
+    SignalState getOutputState(SignalState inputs, uint nFrames) override {
+      return amplitude == 0 ? SignalSilent : SignalLive;
+    }
     
   };
   
@@ -42,42 +63,53 @@ namespace DspBlocks {
     Impulse() : DspBlockSingleWireSpec(0,1) {}
     
     const char* getClassName() override { return "Impulse"; }
+
+    void init() override { sampZero = true; }
     
-    void process() override {
-      auto pin = outputPins[0];
-      WireSpec& ws = pin.wireSpec;
-      memset(&pin.buffers[0][0], 0, sizeof(float) * ws.bufSize);
-      if (sampZero) { pin.buffers[0][0] = 1.0; sampZero = false; }
+    void run(const KernelArgs& args) {
+      float* out = args.outputs[0][0] + args.firstFrame;
+      memset(out, 0, sizeof(float) * args.nFrames);
+      if (sampZero) { out[0] = 1.0; sampZero = false; }
+    }
+
+    Kernel getKernel() override { return { &RunKernel<Impulse>, this }; }
+    void process() override { run(PinArgs()); }
+
+    void CopyStateFrom(DspInterface& other) override {
+      sampZero = static_cast<Impulse&>(other).sampZero;
+    }
+
+    void SaveState(vector<float>& state) override { state.push_back(sampZero); }
+    void RestoreState(const float*& state) override { sampZero = *state++ != 0; }
+
+    // Silent from the second cycle on, so the buffer isn't cleared over and over
+    bool TracksSilence() override { return true; }
+    SignalState getOutputState(SignalState inputs, uint nFrames) override {
+      return sampZero ? SignalLive : SignalSilent;
     }
   };
 
   struct Probe : DspBlockSingleWireSpec {
-    float **buffers = nullptr;  // copy data to this buffer during operation
+    float **buffers = nullptr;  // copy data to this buffer during operation, owned by the graph
     Probe() : DspBlockSingleWireSpec(1,0) {}
     
     const char* getClassName() { return "Probe"; }
 
-    void init() {
-      freeBuffers();
-      buffers = inputPins[0].wireSpec.AllocateBuffers();
+    void ReserveBuffers(BufferArena& arena) override {
+      arena.Reserve(sharedWireSpec, &buffers);
     }
 
-    void freeBuffers() {
-      if (buffers != nullptr) {
-        for (int i = 0; i < inputPins[0].wireSpec.nChannels; i++) {
-          if (buffers[i] != nullptr) delete buffers[i];
-        }
-        delete buffers;
+    void run(const KernelArgs& args) {
+      float** pinBuf = args.inputs[0];
+      for (uint ch = args.firstChannel; ch < args.firstChannel + args.nChannels; ch++) {
+        uint f = args.firstFrame;
+        copy(&pinBuf[ch][f], &pinBuf[ch][f + args.nFrames], buffers[ch] + f);
       }
     }
 
-    void process() {
-      float** pinBuf = inputPins[0].buffers;
-      auto& ws = inputPins[0].wireSpec;
-      for (int ch=0 ; ch < ws.nChannels; ch++) {
-        copy(&pinBuf[ch][0], &pinBuf[ch][ws.bufSize], buffers[ch]);
-      }
-    }
+    Kernel getKernel() override { return { &RunKernel<Probe>, this }; }
+    void process() override { run(PinArgs()); }
+    bool IsChannelIndependent() override { return true; }
 
     float** getBuffers() { return buffers; }
 
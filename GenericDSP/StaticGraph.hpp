@@ -0,0 +1,263 @@
+//
+//  StaticGraph.hpp
+//
+//  Graphs whose blocks and connections are fixed at compile time.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+
+#include <tuple>
+#include <utility>
+
+namespace DspBlocks {
+
+  /*
+   For fixed topologies, a StaticGraph does at compile time what GraphBase does when it
+   is prepared. The blocks are a tuple of concrete types, and the connections an edge list
+   returned by a constexpr function. The processing order and the buffer assignment are
+   worked out by constexpr functions as the template is instantiated, and process()
+   calls each block's run() directly, in that order, so the compiler can inline all of
+   them. Nothing goes through DspInterface or a kernel pointer.
+
+   An edge connects output pin srcPin of block src to input pin dstPin of block dst,
+   blocks being numbered by their position in the tuple. StaticPort as src stands for the
+   graph's input port srcPin, and as dst for its output port dstPin:
+
+     struct TestEdges {
+       static constexpr StaticEdgeList<3> Edges() {
+         return {{ { StaticPort, 0, 0, 1 }, { 1, 0, 0, 0 }, { 0, 0, StaticPort, 0 } }};
+       }
+     };
+     StaticGraph<TestEdges, TwoInputMixer, SineGen> graph(ws);
+
+   All signals share one wire spec, so the blocks have to be DspBlockSingleWireSpec
+   blocks with a run(const KernelArgs&). Blocks have at most MaxStaticPins inputs and
+   outputs, and outputs which aren't connected write to a scratch buffer. A feedback loop
+   or an input connected twice or not at all fails to compile.
+   */
+
+  static const uint MaxStaticPins = 8;
+  static const uint StaticPort = ~0u;
+
+  struct StaticEdge {
+    uint src;
+    uint srcPin;
+    uint dst;
+    uint dstPin;
+  };
+
+  template <size_t N>
+  struct StaticEdgeList {
+    StaticEdge edges[N];
+    static constexpr size_t size() { return N; }
+  };
+
+  // The schedule and the buffer of every pin, -1 for pins with no buffer of their own
+  template <uint NBlocks>
+  struct StaticPlan {
+    uint order[NBlocks];
+    uint nInputs[NBlocks];
+    uint nOutputs[NBlocks];
+    int inputBuffer[NBlocks][MaxStaticPins];
+    int outputBuffer[NBlocks][MaxStaticPins];
+    int inputPortBuffer[MaxStaticPins];
+    int outputPortBuffer[MaxStaticPins];
+    uint nInputPorts;
+    uint nOutputPorts;
+    uint nBuffers;
+  };
+
+  // The last step at which the signal on output srcPin of src is read, the end of the
+  // graph for signals which go to an output port
+  template <size_t NEdges>
+  constexpr int StaticLastRead(const StaticEdge* edges, const int* pos, uint nBlocks,
+                               uint src, uint srcPin, int start) {
+    int last = start;
+    for (size_t e = 0; e < NEdges; e++) {
+      auto& edge = edges[e];
+      if (edge.src != src || edge.srcPin != srcPin) continue;
+      last = max(last, edge.dst == StaticPort ? (int) nBlocks : pos[edge.dst]);
+    }
+    return last;
+  }
+
+  // A buffer whose last signal was done with before start, or a new one
+  constexpr int StaticAssignBuffer(int* busyUntil, uint& nBuffers, int start, int end) {
+    for (uint buf = 0; buf < nBuffers; buf++) {
+      if (busyUntil[buf] < start) {
+        busyUntil[buf] = end;
+        return (int) buf;
+      }
+    }
+    busyUntil[nBuffers] = end;
+    return (int) nBuffers++;
+  }
+
+  // Kahn's algorithm as in GraphBase::SortTopologically, then interval coloring as in
+  // GraphBase::AssignBuffers, less in-place processing. The graphs are small, so edges
+  // are simply scanned rather than indexed.
+
+  template <uint NBlocks, size_t NEdges>
+  constexpr StaticPlan<NBlocks> CompileStaticPlan(const StaticEdgeList<NEdges> list) {
+    StaticPlan<NBlocks> plan {};
+    const StaticEdge* edges = list.edges;
+
+    uint nConnections[NBlocks][MaxStaticPins] {};
+    for (size_t e = 0; e < NEdges; e++) {
+      auto& edge = edges[e];
+      if (edge.srcPin >= MaxStaticPins || edge.dstPin >= MaxStaticPins) throw DspError("too many pins");
+      if (edge.src == StaticPort) {
+        plan.nInputPorts = max(plan.nInputPorts, edge.srcPin + 1);
+      } else {
+        if (edge.src >= NBlocks) throw DspError("edge from a block which doesn't exist");
+        plan.nOutputs[edge.src] = max(plan.nOutputs[edge.src], edge.srcPin + 1);
+      }
+      if (edge.dst == StaticPort) {
+        plan.nOutputPorts = max(plan.nOutputPorts, edge.dstPin + 1);
+      } else {
+        if (edge.dst >= NBlocks) throw DspError("edge to a block which doesn't exist");
+        plan.nInputs[edge.dst] = max(plan.nInputs[edge.dst], edge.dstPin + 1);
+        nConnections[edge.dst][edge.dstPin]++;
+      }
+    }
+    for (uint b = 0; b < NBlocks; b++) {
+      for (uint pin = 0; pin < plan.nInputs[b]; pin++) {
+        if (nConnections[b][pin] != 1) throw DspError("input not connected exactly once");
+      }
+    }
+
+    uint pending[NBlocks] {};
+    for (size_t e = 0; e < NEdges; e++) {
+      if (edges[e].src != StaticPort && edges[e].dst != StaticPort) { pending[edges[e].dst]++; }
+    }
+    uint ready[NBlocks] {};
+    uint nReady = 0;
+    for (uint b = NBlocks; b-- > 0; ) {
+      if (pending[b] == 0) { ready[nReady++] = b; }
+    }
+    int pos[NBlocks] {};
+    uint nScheduled = 0;
+    while (nReady > 0) {
+      uint b = ready[--nReady];
+      pos[b] = (int) nScheduled;
+      plan.order[nScheduled++] = b;
+      for (size_t e = NEdges; e-- > 0; ) {
+        auto& edge = edges[e];
+        if (edge.src == b && edge.dst != StaticPort && --pending[edge.dst] == 0) {
+          ready[nReady++] = edge.dst;
+        }
+      }
+    }
+    if (nScheduled != NBlocks) throw DspError("graph contains a feedback loop");
+
+    int busyUntil[NBlocks * MaxStaticPins + MaxStaticPins] {};
+    for (uint pin = 0; pin < MaxStaticPins; pin++) {
+      plan.inputPortBuffer[pin] = -1;
+      plan.outputPortBuffer[pin] = -1;
+    }
+    for (uint b = 0; b < NBlocks; b++) {
+      for (uint pin = 0; pin < MaxStaticPins; pin++) {
+        plan.inputBuffer[b][pin] = -1;
+        plan.outputBuffer[b][pin] = -1;
+      }
+    }
+    for (uint pin = 0; pin < plan.nInputPorts; pin++) {
+      int last = StaticLastRead<NEdges>(edges, pos, NBlocks, StaticPort, pin, -1);
+      plan.inputPortBuffer[pin] = StaticAssignBuffer(busyUntil, plan.nBuffers, -1, last);
+    }
+    for (uint step = 0; step < NBlocks; step++) {
+      uint b = plan.order[step];
+      for (uint pin = 0; pin < plan.nOutputs[b]; pin++) {
+        int last = StaticLastRead<NEdges>(edges, pos, NBlocks, b, pin, (int) step);
+        if (last > (int) step) {
+          plan.outputBuffer[b][pin] = StaticAssignBuffer(busyUntil, plan.nBuffers, (int) step, last);
+        }
+      }
+    }
+    for (size_t e = 0; e < NEdges; e++) {
+      auto& edge = edges[e];
+      int buf = edge.src == StaticPort ? plan.inputPortBuffer[edge.srcPin] : plan.outputBuffer[edge.src][edge.srcPin];
+      if (edge.dst == StaticPort) {
+        plan.outputPortBuffer[edge.dstPin] = buf;
+      } else {
+        plan.inputBuffer[edge.dst][edge.dstPin] = buf;
+      }
+    }
+    return plan;
+  }
+
+  template <class EdgeSource, class... Blocks>
+  struct StaticGraph {
+    static const uint NBlocks = sizeof...(Blocks);
+    static constexpr StaticPlan<NBlocks> plan = CompileStaticPlan<NBlocks>(EdgeSource::Edges());
+
+    tuple<Blocks...> blocks;
+    WireSpec wireSpec;
+    BufferArena arena;
+    float** buffers[plan.nBuffers + 1];   // the last one takes what nobody reads
+    float** pinTable[NBlocks][2 * MaxStaticPins];
+    KernelArgs args[NBlocks];             // by block
+
+    StaticGraph(WireSpec ws) : wireSpec(ws) {
+      for (uint buf = 0; buf <= plan.nBuffers; buf++) { arena.Reserve(ws, &buffers[buf]); }
+      ForEachBlock(make_index_sequence<NBlocks>(), [&](auto& block) {
+        block.sharedWireSpec = ws;
+        block.ReserveBuffers(arena);
+      });
+      arena.Commit();
+      for (uint b = 0; b < NBlocks; b++) {
+        for (uint pin = 0; pin < MaxStaticPins; pin++) {
+          pinTable[b][pin] = Buffer(plan.inputBuffer[b][pin]);
+          pinTable[b][MaxStaticPins + pin] = Buffer(plan.outputBuffer[b][pin]);
+        }
+        args[b] = { &pinTable[b][0], &pinTable[b][MaxStaticPins], 0, ws.bufSize, 0, ws.nChannels };
+      }
+      InitBlocks();
+    }
+
+    StaticGraph(const StaticGraph&) = delete;
+
+    float** Buffer(int idx) { return idx < 0 ? buffers[plan.nBuffers] : buffers[idx]; }
+
+    template <size_t I>
+    typename tuple_element<I, tuple<Blocks...>>::type& Block() { return get<I>(blocks); }
+
+    void GetPortBuffers(float **&inputBuffers, float **&outputBuffers) {
+      inputBuffers = Buffer(plan.inputPortBuffer[0]);
+      outputBuffers = Buffer(plan.outputPortBuffer[0]);
+    }
+
+    void InitBlocks() {
+      ForEachBlock(make_index_sequence<NBlocks>(), [](auto& block) { block.init(); });
+    }
+
+    void process() { RunSteps(make_index_sequence<NBlocks>()); }
+
+  private:
+
+    template <size_t... I, class Func>
+    void ForEachBlock(index_sequence<I...>, Func func) {
+      int expand[] = { 0, (func(get<I>(blocks)), 0)... };
+      (void) expand;
+    }
+
+    template <size_t Step>
+    void RunStep() {
+      constexpr uint b = plan.order[Step];
+      get<b>(blocks).run(args[b]);
+    }
+
+    template <size_t... Step>
+    void RunSteps(index_sequence<Step...>) {
+      int expand[] = { 0, (RunStep<Step>(), 0)... };
+      (void) expand;
+    }
+
+  };
+
+  template <class EdgeSource, class... Blocks>
+  constexpr StaticPlan<StaticGraph<EdgeSource, Blocks...>::NBlocks> StaticGraph<EdgeSource, Blocks...>::plan;
+
+}
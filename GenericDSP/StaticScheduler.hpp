@@ -0,0 +1,230 @@
+//
+//  StaticScheduler.hpp
+//
+//  Runs the plan of a prepared GraphBase on a fixed number of threads, from a
+//  schedule worked out ahead of time from measured block costs.
+//
+
+#pragma once
+
+#include "GenericDsp.hpp"
+#include "Parking.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace DspBlocks {
+
+  // For small buffers, handing out work dynamically costs about as much as the work
+  // itself. This assigns every step of a graph's plan to a thread once, up front: the
+  // cost of each block is measured with a few warm up calls, and steps are then list
+  // scheduled by critical path, HEFT style. Each step has a rank which is its own cost
+  // plus the largest rank among its successors, steps are taken in order of decreasing
+  // rank, and each goes to the thread on which it would finish first. At run time each
+  // thread just walks its own list, and only waits where a step has a predecessor on
+  // another thread.
+  //
+  // Like ParallelExecutor, the graph has to be prepared with reuseBuffers turned off,
+  // and workers wait for the next cycle in a Parking.
+
+  struct StaticScheduler {
+
+    // A step in a thread's list, with the range in waits of the steps on other threads
+    // which have to be done before it can run
+    struct ThreadStep {
+      uint step;
+      uint waitStart;
+      uint waitEnd;
+    };
+
+    typedef chrono::steady_clock Clock;
+
+    GraphBase& graph;
+    uint nThreads;
+    uint nSteps = 0;
+    vector<double> cost;              // microseconds per step
+    vector<double> rank;
+    vector<uint> threadOf;
+    vector<double> predictedFinish;
+    vector<vector<ThreadStep>> threadSteps;
+    vector<uint> waits;
+    double predictedMakespan = 0;
+
+    // the cycle in which each step was last run, which is what waiting threads watch
+    unique_ptr<atomic<uint>[]> doneInCycle;
+    atomic<uint> cycle { 0 };
+    atomic<uint> finishedWorkers { 0 };
+    atomic<bool> stopping { false };
+    Parking parking;
+    vector<thread> workers;
+
+    // achieved makespan, over the cycles run so far
+    double totalMicros = 0;
+    double worstMicros = 0;
+    uint nCycles = 0;
+
+    StaticScheduler(GraphBase& graph, uint nThreads, uint nWarmups = 8) :
+            graph(graph), nThreads(max(nThreads, 1u)) {
+      if (graph.reuseBuffers) {
+        throw DspError("graph must be prepared without buffer reuse to run in parallel");
+      }
+      nSteps = (uint) graph.plan.size();
+      cost = graph.MeasureStepCosts(nWarmups);
+      ComputeRanks();
+      AssignThreads();
+      doneInCycle.reset(new atomic<uint>[nSteps]);
+      for (uint step = 0; step < nSteps; step++) { doneInCycle[step].store(0); }
+      for (uint i = 1; i < this->nThreads; i++) {
+        workers.emplace_back([this, i] { WorkerLoop(i); });
+      }
+      graph.attachedExecutors++;
+    }
+
+    StaticScheduler(const StaticScheduler&) = delete;
+
+    ~StaticScheduler() {
+      graph.attachedExecutors--;
+      stopping.store(true, memory_order_release);
+      parking.Wake();
+      for (auto& worker : workers) { worker.join(); }
+    }
+
+    // ------------------ Schedule Construction --------------------
+
+    // The plan is in topological order, so walking it backwards sees every step's
+    // successors before the step itself
+
+    void ComputeRanks() {
+      auto& t = graph.topology;
+      rank.assign(nSteps, 0);
+      for (uint step = nSteps; step-- > 0; ) {
+        uint id = graph.schedule[step];
+        double longest = 0;
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          longest = max(longest, rank[t.schedulePos[t.successors[e]]]);
+        }
+        rank[step] = cost[step] + longest;
+      }
+    }
+
+    // Predecessors never rank below their successors, and ties go to the earlier step
+    // in the plan, so taking steps by rank still sees every predecessor first. Each step
+    // goes to the thread where it would finish earliest, given when that thread is free
+    // and when its predecessors finish. Each thread's list keeps the order in which steps
+    // were assigned, and a step only ever waits for steps assigned before it, so the
+    // threads can't deadlock.
+
+    void AssignThreads() {
+      auto& t = graph.topology;
+      vector<uint> order(nSteps);
+      for (uint step = 0; step < nSteps; step++) { order[step] = step; }
+      stable_sort(order.begin(), order.end(), [&](uint a, uint b) { return rank[a] > rank[b]; });
+
+      vector<vector<uint>> predecessors(nSteps);
+      for (uint step = 0; step < nSteps; step++) {
+        uint id = graph.schedule[step];
+        for (uint e = t.successorStart[id]; e < t.successorStart[id + 1]; e++) {
+          predecessors[t.schedulePos[t.successors[e]]].push_back(step);
+        }
+      }
+
+      vector<double> threadFree(nThreads, 0);
+      threadOf.assign(nSteps, 0);
+      predictedFinish.assign(nSteps, 0);
+      threadSteps.assign(nThreads, vector<ThreadStep>());
+      waits.clear();
+      predictedMakespan = 0;
+      for (auto step : order) {
+        double ready = 0;
+        for (auto pred : predecessors[step]) { ready = max(ready, predictedFinish[pred]); }
+        uint best = 0;
+        double bestFinish = 0;
+        for (uint th = 0; th < nThreads; th++) {
+          double finish = max(ready, threadFree[th]) + cost[step];
+          if (th == 0 || finish < bestFinish) { best = th; bestFinish = finish; }
+        }
+        threadOf[step] = best;
+        predictedFinish[step] = bestFinish;
+        threadFree[best] = bestFinish;
+        predictedMakespan = max(predictedMakespan, bestFinish);
+        ThreadStep ts { step, (uint) waits.size(), 0 };
+        for (auto pred : predecessors[step]) {
+          if (threadOf[pred] != best) { waits.push_back(pred); }
+        }
+        ts.waitEnd = (uint) waits.size();
+        threadSteps[best].push_back(ts);
+      }
+    }
+
+    // ------------------ Execution --------------------
+
+    // Spin on a condition, but give up the core now and then in case the thread we are
+    // waiting for shares it
+    template <class Condition>
+    static void SpinUntil(Condition done) {
+      for (uint spins = 0; !done(); spins++) {
+        if (spins >= 64) { this_thread::yield(); }
+      }
+    }
+
+    void RunThreadSteps(uint th, uint thisCycle) {
+      for (auto& ts : threadSteps[th]) {
+        for (uint w = ts.waitStart; w < ts.waitEnd; w++) {
+          auto& done = doneInCycle[waits[w]];
+          SpinUntil([&] { return done.load(memory_order_acquire) == thisCycle; });
+        }
+        auto& entry = graph.plan[ts.step];
+        if (entry.kernel.func != nullptr && graph.IsDemanded(ts.step)) { entry.kernel.func(entry.kernel.state, entry.args); }
+        doneInCycle[ts.step].store(thisCycle, memory_order_release);
+      }
+    }
+
+    // Runs one cycle, and returns when every thread has worked through its list
+    void process() {
+      auto start = Clock::now();
+      graph.ApplyParameterChanges();
+      finishedWorkers.store(0, memory_order_relaxed);
+      uint thisCycle = cycle.fetch_add(1, memory_order_acq_rel) + 1;
+      parking.Wake();
+      RunThreadSteps(0, thisCycle);
+      SpinUntil([&] { return finishedWorkers.load(memory_order_acquire) == workers.size(); });
+      chrono::duration<double, micro> elapsed = Clock::now() - start;
+      totalMicros += elapsed.count();
+      worstMicros = max(worstMicros, elapsed.count());
+      nCycles++;
+    }
+
+    // Workers are started before the first cycle, so they must not miss cycle 1 even if
+    // they only get going after it was started
+    void WorkerLoop(uint th) {
+      uint seen = 0;
+      for (;;) {
+        parking.Wait([&] {
+          return stopping.load(memory_order_acquire) || cycle.load(memory_order_acquire) != seen;
+        });
+        if (stopping.load(memory_order_acquire)) return;
+        uint current = cycle.load(memory_order_acquire);
+        RunThreadSteps(th, current);
+        finishedWorkers.fetch_add(1, memory_order_acq_rel);
+        seen = current;
+      }
+    }
+
+    void Report() {
+      cout << "static schedule on " << nThreads << " threads\n";
+      for (uint th = 0; th < nThreads; th++) {
+        cout << "  thread " << th << ": " << threadSteps[th].size() << " blocks\n";
+      }
+      cout << "  cross thread waits: " << waits.size() << "\n";
+      cout << "  predicted makespan: " << predictedMakespan << " us\n";
+      if (nCycles > 0) {
+        cout << "  achieved makespan: " << totalMicros / nCycles << " us average, ";
+        cout << worstMicros << " us worst, over " << nCycles << " cycles\n";
+      }
+    }
+
+  };
+
+}